@@ -0,0 +1,2742 @@
+/*- libntscj
+ *
+ * COPYRIGHT: 2023 by Chris Bussard
+ * LICENSE: GPLv3
+ *
+ * The color conversion engine behind ntscjpng. See ntscj.h for the interface.
+ * quasirandom dithering method devised by Martin Roberts.
+ *
+ * To build as a static library:
+ * gcc -O2 -c ntscj.c && ar rcs libntscj.a ntscj.o
+ * or as a shared library:
+ * gcc -O2 -shared -fPIC -o libntscj.so ntscj.c -lm -pthread
+ * 
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "ntscj.h"
+
+// precomputed NTSC-J to SRGB color gamut conversion using Bradford Method
+// Note:
+// NTSC-J television sets had a whitepoint of 9300K+27mpcd (x=0.281, y=0.311)
+// NTSC-J broadcasts had a whitepoint of 9300K+8mpcd (x=0.2838 y=0.2981)
+// And neither of those is quite the same as CIE 9300K (x=0.2848 y=0.2932 or x=0.28315, y=0.29711, depending on which source you consult; discrepancy might relate to rivision of Planck's Law constants???)
+// This matrix uses 9300K+27mpcd for NTSC-J white point and x=0.312713, y=0.329016 for D65 white point
+
+static const float NTSCJtoSRGBConversionMatrix[3][3] = {
+    {1.34756301456925, -0.276463760747096, -0.071099263267176},
+    {-0.031150036968175, 0.956512223260545, 0.074637860817515},
+    {-0.024443490594835, -0.048150182045316, 1.07259361295816}
+};
+
+static const float SRGBtoNTSCJConversionMatrix[3][3] = {
+    {0.747740261849856, 0.217853505133354, 0.034406264690912},
+    {0.022941129531242, 1.04849963723505, -0.071440739296512},
+    {0.018070185951324, 0.052033179887888, 0.929896593506351}
+};
+
+// Gamut profiles
+// A profile is the pair of Bradford matrices between one gamut and sRGB, worked out once from the gamut's primaries and white point,
+// so the conversion itself is the same whichever profile it uses. The built-in profiles are below, and ntscj_add_profile() adds more.
+// Profiles are never freed, so a pointer to one stays good for the life of the process.
+struct ntscj_profile {
+    const char* name;
+    ntscj_gamut gamut;
+    float matrices[2][3][3]; // gamut to sRGB, then sRGB to gamut
+    int32_t fixedmatrices[2][3][3]; // the same in Q14, for the fixed-point path
+    struct ntscj_profile* next; // profiles added at run time, newest first
+};
+
+// The NTSC 1953 primaries, which the constant matrices above assume
+#define NTSC1953_PRIMARIES {0.67, 0.33}, {0.21, 0.71}, {0.14, 0.08}
+// the same D65 the constant matrices use
+#define D65_WHITE {0.312713, 0.329016}
+
+static ntscj_profile builtinprofiles[] = {
+    // the default. Its matrices are the constants above rather than computed, so the output never changes from one build to the next.
+    {.name = "ntscj", .gamut = {NTSC1953_PRIMARIES, {0.281, 0.311}}}, // 9300K+27mpcd receivers
+    {.name = "ntscj-broadcast", .gamut = {NTSC1953_PRIMARIES, {0.2838, 0.2981}}}, // 9300K+8mpcd broadcasts
+    {.name = "d93", .gamut = {NTSC1953_PRIMARIES, {0.2848, 0.2932}}}, // CIE 9300K
+    {.name = "ntsc1953", .gamut = {NTSC1953_PRIMARIES, {0.310, 0.316}}}, // illuminant C
+    {.name = "smpte-c", .gamut = {{0.630, 0.340}, {0.310, 0.595}, {0.155, 0.070}, D65_WHITE}},
+    {.name = "pal", .gamut = {{0.64, 0.33}, {0.29, 0.60}, {0.15, 0.06}, D65_WHITE}} // EBU Tech. 3213
+};
+#define BUILTIN_PROFILES ((int)(sizeof builtinprofiles / sizeof builtinprofiles[0]))
+#define DEFAULT_PROFILE (&builtinprofiles[0])
+
+static const ntscj_gamut srgbgamut = {{0.64, 0.33}, {0.30, 0.60}, {0.15, 0.06}, D65_WHITE};
+
+
+// clamp a float between 0.0 and 1.0
+static float clampfloat(float input){
+    if (input < 0.0) return 0.0;
+    if (input > 1.0) return 1.0;
+    return input;
+}
+
+// triangle fold of the 0-1 quasirandom sequence value into the dither offset
+static inline float folddither(float dither){
+    if (dither < 0.5){
+        dither = 2.0 * dither;
+    }
+    else if (dither > 0.5) {
+        dither = 2.0 - (2.0 * dither);
+    }
+    // if we ever get exactly 0.5, don't touch it; otherwise we might end up adding 1.0 to a black that means transparency.
+    return dither;
+}
+
+// scale a 0-1 float value to 0-255 and add the dither offset
+static inline uint8_t applydither(float input, float dither){
+    int output = (int)((input * 255.0) + dither);
+    if (output > 255) output = 255;
+    if (output < 0) output = 0;
+    return (uint8_t)output;
+}
+
+// the same for 16-bit output
+static inline uint16_t applydither16(float input, float dither){
+    int output = (int)((input * 65535.0) + dither);
+    if (output > 65535) output = 65535;
+    if (output < 0) output = 0;
+    return (uint16_t)output;
+}
+
+// convert a 0-1 float value to 0-255 uint8_t value with Martin Roberts' quasirandom dithering
+// see: https://extremelearning.com.au/unreasonable-effectiveness-of-quasirandom-sequences/
+// Aside from being just beautifully elegant, this dithering method is also perfect for our use case,
+// in which our input might be might be a "swizzled" texture.
+// These pose a problem for many other dithering methods.
+// Any kind of error diffusion will diffuse error across swizzled tile boundaries.
+// Even plain old ordered dithering is locally wrong where swizzled tile boundaries
+// often don't line up with the Bayer matrix boundaries.
+// But quasirandom doesn't care where you cut and splice it; it's still balanced.
+// (Blue noise would work too, but that's a huge amount of overhead, while this is a very short function.)
+// This is the reference version; convertrows() uses the tabled version below, which gives the same results.
+static uint8_t quasirandomdither(float input, int x, int y){
+    x++; // avoid x=0
+    y++; // avoid y=0
+    double dummy;
+    float dither = modf(((float)x * 0.7548776662) + ((float)y * 0.56984029), &dummy);
+    return applydither(input, folddither(dither));
+}
+
+// The sequence position is a column term plus a row term, so the column terms can be tabled once per thread,
+// the row terms worked out once per row, and the inner loop is just an add, a truncate, and the fold.
+// Each term is worked out exactly the same as in quasirandomdither(), and for a positive double,
+// subtracting the truncated value gives exactly what modf() does, so the output is identical.
+// (Unless the compiler contracts quasirandomdither() into a fused multiply-add; the selftest catches that.)
+static inline double dithercolumnterm(int x){
+    return (float)(x + 1) * 0.7548776662;
+}
+
+static inline double ditherrowterm(int y){
+    return (float)(y + 1) * 0.56984029;
+}
+
+static inline float tabledither(double column, double row){
+    double position = column + row;
+    return folddither((float)(position - (double)(long long)position));
+}
+
+// Transfer functions
+// How 0-1 sample values are decoded to linear light and encoded back again; sRGB unless the decode and encode options say otherwise.
+// The FF7 videos had banding near black when decoded with any piecewise "toe slope" gamma function, suggesting that a pure curve function was needed,
+// so a pure 2.2 curve and BT.1886 (a pure 2.4 curve, taking the display's black as 0) can be picked for either end instead.
+// Each one has its own tables, so the choice costs nothing per pixel.
+
+// sRGB gamma functions
+static float togamma(float input){
+    if (input <= 0.0031308){
+        return clampfloat(input * 12.92);
+    }
+    return clampfloat((1.055 * pow(input, (1.0/2.4))) - 0.055);
+}
+static float tolinear(float input){
+    if (input <= 0.04045){
+        return clampfloat(input / 12.92);
+    }
+    return clampfloat(pow((input + 0.055) / 1.055, 2.4));
+}
+
+// pure power curves
+static float togamma22(float input){
+    return clampfloat(pow(input, (1.0/2.2)));
+}
+static float tolinear22(float input){
+    return clampfloat(pow(input, 2.2));
+}
+static float togamma1886(float input){
+    return clampfloat(pow(input, (1.0/2.4)));
+}
+static float tolinear1886(float input){
+    return clampfloat(pow(input, 2.4));
+}
+
+// Interpolated lookup table for linear to sRGB conversion.
+// Unlike decoding, the input here is a continuous float, so we sample togamma() at 65536 evenly spaced points and interpolate linearly.
+// Worst case absolute error is about 5.3e-7, right above the toe of the curve at 0.0031308, or about 1/7500 of an 8-bit step.
+// (A 4096 entry table is 16 times smaller but about 30 times worse, which was enough to flip a few pixels in 100,000.)
+// So the dithered 8-bit output only differs from the pow() path when the exact value lands that close to a rounding boundary,
+// and then only by 1.
+// Set the exact option to go back to calling togamma() for validation.
+#define GAMMA_TABLE_SIZE 65536
+
+// A pure power curve is vertical at 0, so evenly spaced samples are no good near black: the first step alone is off by almost half an 8-bit step.
+// Its table is spaced evenly in the bits of the float instead, 2048 samples to each of the 32 octaves below 1.0 (which is GAMMA_TABLE_SIZE again),
+// so the steps shrink along with the values. Below 2^-32 it interpolates down to 0, which is off by less than 1/40 of an 8-bit step.
+#define POWER_TABLE_FLOOR 0x2f800000 // the bits of 2^-32
+#define POWER_TABLE_SHIFT 12 // mantissa bits below the 11 that pick the sample
+
+// One transfer function and its tables. Only the sRGB tables are built up front; the rest are built by preparetransfer() when something needs them.
+typedef struct transfer {
+    const char* name;
+    float (*tolinear)(float);
+    float (*togamma)(float);
+    bool power; // gammatable is spaced for a pure power curve
+    bool decodeready; // which tables have been built, under transferlock
+    bool encodeready;
+    bool decode16ready;
+    // Our 8-bit input can only take 256 distinct values per channel, so there's no sense calling pow() for every pixel.
+    float lineartable[256];
+    float lineartable16[65536];
+    float gammatable[GAMMA_TABLE_SIZE + 1];
+} transfer;
+
+// indexed by ntscj_transfer
+static transfer transfers[] = {
+    {.name = "srgb", .tolinear = tolinear, .togamma = togamma},
+    {.name = "2.2", .tolinear = tolinear22, .togamma = togamma22, .power = true},
+    {.name = "bt1886", .tolinear = tolinear1886, .togamma = togamma1886, .power = true}
+};
+#define TRANSFERS ((int)(sizeof transfers / sizeof transfers[0]))
+
+static pthread_mutex_t transferlock = PTHREAD_MUTEX_INITIALIZER;
+
+static void initlineartable(transfer* curve){
+    for (int i=0; i<256; i++){
+        curve->lineartable[i] = curve->tolinear(i/255.0);
+    }
+}
+
+// The same for 16-bit input. Only built the first time a 16-bit image comes along, since it's 65536 calls to pow().
+static void initlineartable16(transfer* curve){
+    for (int i=0; i<65536; i++){
+        curve->lineartable16[i] = curve->tolinear(i/65535.0);
+    }
+}
+
+static void initgammatable(transfer* curve){
+    for (int i=0; i<=GAMMA_TABLE_SIZE; i++){
+        if (curve->power){
+            uint32_t bits = POWER_TABLE_FLOOR + ((uint32_t)i << POWER_TABLE_SHIFT);
+            float input;
+            memcpy(&input, &bits, sizeof input);
+            curve->gammatable[i] = curve->togamma(input);
+        }
+        else {
+            curve->gammatable[i] = curve->togamma((float)i / GAMMA_TABLE_SIZE);
+        }
+    }
+}
+
+// Build whichever of the asked for tables haven't been built yet. Safe to call from any thread.
+static void preparetransfer(transfer* curve, bool decode, bool encode, bool decode16){
+    pthread_mutex_lock(&transferlock);
+    if (decode && !curve->decodeready){
+        initlineartable(curve);
+        curve->decodeready = true;
+    }
+    if (encode && !curve->encodeready){
+        initgammatable(curve);
+        curve->encodeready = true;
+    }
+    if (decode16 && !curve->decode16ready){
+        initlineartable16(curve);
+        curve->decode16ready = true;
+    }
+    pthread_mutex_unlock(&transferlock);
+}
+
+// Everything the float conversion of a color needs besides the color, fixed for the life of a context.
+typedef struct pipeline {
+    const ntscj_profile* profile;
+    const transfer* decode;
+    const transfer* encode;
+    bool exact; // encode with the transfer function itself instead of the table
+} pipeline;
+
+// sRGB at both ends with the default profile, for the self test
+static const pipeline defaultpipeline = {DEFAULT_PROFILE, &transfers[NTSCJ_TRANSFER_SRGB], &transfers[NTSCJ_TRANSFER_SRGB], false};
+
+static ntscj_transfer validtransfer(ntscj_transfer curve){
+    return (((int)curve >= 0) && ((int)curve < TRANSFERS)) ? curve : NTSCJ_TRANSFER_SRGB;
+}
+
+// The pipeline for a set of options, with its tables built.
+static void makepipeline(const ntscj_options* options, pipeline* pipe){
+    transfer* decode = &transfers[validtransfer(options->decode)];
+    transfer* encode = &transfers[validtransfer(options->encode)];
+    preparetransfer(decode, true, false, false);
+    preparetransfer(encode, false, true, false);
+    pipe->profile = (options->profile != NULL) ? options->profile : DEFAULT_PROFILE;
+    pipe->decode = decode;
+    pipe->encode = encode;
+    pipe->exact = options->exact;
+}
+
+// input must already be clamped to 0-1
+static inline float fasttogamma(const float* gammatable, float input){
+    float position = input * GAMMA_TABLE_SIZE;
+    int index = (int)position;
+    if (index >= GAMMA_TABLE_SIZE) index = GAMMA_TABLE_SIZE - 1;
+    float fraction = position - (float)index;
+    return gammatable[index] + ((gammatable[index + 1] - gammatable[index]) * fraction);
+}
+
+// fasttogamma() for a pure power curve's table
+static inline float fastpowertogamma(const float* gammatable, float input){
+    int32_t bits;
+    memcpy(&bits, &input, sizeof bits);
+    // (signed, so -0.0 lands here too)
+    if (bits < POWER_TABLE_FLOOR) return gammatable[0] * (input * 4294967296.0f);
+    uint32_t offset = (uint32_t)(bits - POWER_TABLE_FLOOR);
+    uint32_t index = offset >> POWER_TABLE_SHIFT;
+    if (index >= GAMMA_TABLE_SIZE) return gammatable[GAMMA_TABLE_SIZE];
+    float fraction = (float)(offset & ((1u << POWER_TABLE_SHIFT) - 1)) * (1.0f / (1 << POWER_TABLE_SHIFT));
+    return gammatable[index] + ((gammatable[index + 1] - gammatable[index]) * fraction);
+}
+
+// linear to the output encoding for a clamped 0-1 value, by table unless exact
+static inline float encodegamma(const pipeline* pipe, float input){
+    if (pipe->exact) return pipe->encode->togamma(input);
+    return pipe->encode->power ? fastpowertogamma(pipe->encode->gammatable, input) : fasttogamma(pipe->encode->gammatable, input);
+}
+
+// encodegamma() on a whole array in place
+static void encodegammarow(const pipeline* pipe, float* values, int count){
+    const float* gammatable = pipe->encode->gammatable;
+    if (pipe->exact){
+        for (int i=0; i<count; i++){
+            values[i] = pipe->encode->togamma(values[i]);
+        }
+    }
+    else if (pipe->encode->power){
+        for (int i=0; i<count; i++){
+            values[i] = fastpowertogamma(gammatable, values[i]);
+        }
+    }
+    else {
+        for (int i=0; i<count; i++){
+            values[i] = fasttogamma(gammatable, values[i]);
+        }
+    }
+}
+
+// Flags for colors that fell outside the destination gamut and had to be clamped.
+#define CLIPPED_LOW 1
+#define CLIPPED_HIGH 2
+
+// convertcolor() below for a color that's already linear light, for when the input isn't 8-bit.
+static int convertlinearcolor(float redvalue, float greenvalue, float bluevalue, const pipeline* pipe, int mode, float output[3]){
+    
+    // Multiply by one of the profile's gamut conversion Bradford matrices
+    const float (*matrix)[3] = pipe->profile->matrices[(mode == 1) ? 0 : 1];
+    float newred = matrix[0][0] * redvalue + matrix[0][1] * greenvalue + matrix[0][2] * bluevalue;
+    float newgreen = matrix[1][0] * redvalue + matrix[1][1] * greenvalue + matrix[1][2] * bluevalue;
+    float newblue = matrix[2][0] * redvalue + matrix[2][1] * greenvalue + matrix[2][2] * bluevalue;
+    
+    int clipped = 0;
+    if ((newred < 0.0) || (newgreen < 0.0) || (newblue < 0.0)) clipped |= CLIPPED_LOW;
+    if ((newred > 1.0) || (newgreen > 1.0) || (newblue > 1.0)) clipped |= CLIPPED_HIGH;
+    
+    // clamp values to 0 to 1 range
+    newred = clampfloat(newred);
+    newgreen = clampfloat(newgreen);
+    newblue = clampfloat(newblue);
+    
+    // back to sRGB
+    output[0] = encodegamma(pipe, newred);
+    output[1] = encodegamma(pipe, newgreen);
+    output[2] = encodegamma(pipe, newblue);
+    
+    return clipped;
+}
+
+// Run one 8-bit color through the whole gamut conversion, up to but not including dithering.
+// mode 1 is from the profile's gamut (NTSC-J by default) to sRGB, mode 2 is from sRGB to it.
+// output receives the red, green, and blue values as 0-1 floats.
+// Returns CLIPPED_LOW and/or CLIPPED_HIGH if the color had to be clamped.
+static int convertcolor(uint8_t red, uint8_t green, uint8_t blue, const pipeline* pipe, int mode, float output[3]){
+    // to linear RGB
+    const float* lineartable = pipe->decode->lineartable;
+    return convertlinearcolor(lineartable[red], lineartable[green], lineartable[blue], pipe, mode, output);
+}
+
+// Memo of convertcolor() results, keyed by 24-bit input color.
+// Real textures tend to have a few thousand unique colors at most, so this saves re-running the matrix and gamma math for every pixel.
+// Open addressing hash table that doubles in size whenever it gets half full.
+// The direction can change from one call to the next, so it's part of the key; the rest of the pipeline is fixed for the life of the context.
+typedef struct colormemo {
+    unsigned int* keys; // 24-bit color with the mode above it, + 1, so that 0 can mean empty
+    float (*values)[3];
+    unsigned char* clipped;
+    unsigned int size; // always a power of 2
+    unsigned int count;
+} colormemo;
+
+#define MEMO_INITIAL_SIZE 4096
+
+static bool initcolormemo(colormemo* memo, unsigned int size){
+    memo->keys = calloc(size, sizeof(unsigned int));
+    memo->values = malloc(size * sizeof(float[3]));
+    memo->clipped = malloc(size);
+    memo->size = size;
+    memo->count = 0;
+    if ((memo->keys == NULL) || (memo->values == NULL) || (memo->clipped == NULL)){
+        free(memo->keys);
+        free(memo->values);
+        free(memo->clipped);
+        memo->keys = NULL;
+        memo->values = NULL;
+        memo->clipped = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void freecolormemo(colormemo* memo){
+    free(memo->keys);
+    free(memo->values);
+    free(memo->clipped);
+    memo->keys = NULL;
+    memo->values = NULL;
+    memo->clipped = NULL;
+    memo->size = 0;
+    memo->count = 0;
+}
+
+static unsigned int memoslot(const colormemo* memo, unsigned int key){
+    unsigned int mask = memo->size - 1;
+    unsigned int slot = (key * 2654435761u) & mask; // Knuth's multiplicative hash
+    while ((memo->keys[slot] != 0) && (memo->keys[slot] != key)){
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// double the size of the memo; if we can't get the memory, keep going with the old one
+static void growcolormemo(colormemo* memo){
+    colormemo bigger;
+    if (!initcolormemo(&bigger, memo->size * 2)) return;
+    for (unsigned int i=0; i<memo->size; i++){
+        if (memo->keys[i] != 0){
+            unsigned int slot = memoslot(&bigger, memo->keys[i]);
+            bigger.keys[slot] = memo->keys[i];
+            memcpy(bigger.values[slot], memo->values[i], sizeof(float[3]));
+            bigger.clipped[slot] = memo->clipped[i];
+        }
+    }
+    bigger.count = memo->count;
+    freecolormemo(memo);
+    *memo = bigger;
+}
+
+// convertcolor(), but look in the memo first
+static int memoconvertcolor(colormemo* memo, uint8_t red, uint8_t green, uint8_t blue, const pipeline* pipe, int mode, float output[3]){
+    unsigned int key = (((unsigned int)mode << 24) | ((unsigned int)red << 16) | ((unsigned int)green << 8) | (unsigned int)blue) + 1;
+    unsigned int slot = memoslot(memo, key);
+    if (memo->keys[slot] == 0){
+        if ((memo->count + 1) * 2 > memo->size){
+            growcolormemo(memo);
+            // if growing failed, just don't memoize this one; the memo never gets more than half full, so memoslot() always finds a free slot
+            if ((memo->count + 1) * 2 > memo->size){
+                return convertcolor(red, green, blue, pipe, mode, output);
+            }
+            slot = memoslot(memo, key);
+        }
+        memo->clipped[slot] = (unsigned char)convertcolor(red, green, blue, pipe, mode, memo->values[slot]);
+        memo->keys[slot] = key;
+        memo->count++;
+    }
+    memcpy(output, memo->values[slot], sizeof(float[3]));
+    return memo->clipped[slot];
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+// Row kernels for the matrix multiply and clamp
+// The pixels of a row are gathered into separate red, green, and blue arrays (SoA) so that 4 or 8 pixels can go through the matrix at once.
+// Every version does exactly the same float multiplies and adds in the same order as convertcolor(), without FMA, so the results are bit-identical.
+// (That assumes the compiler doesn't contract the scalar code into FMA either, e.g. with -march=native; add -ffp-contract=off if it does.)
+
+// multiply count pixels by matrix and clamp to 0-1, in place, adding the number of clamped pixels to clips
+typedef void (*matrixrowfunction)(const float matrix[3][3], float* red, float* green, float* blue, int count, ntscj_clipcount* clips);
+
+// reference scalar version
+static void matrixrowscalar(const float matrix[3][3], float* red, float* green, float* blue, int count, ntscj_clipcount* clips){
+    long long low = 0;
+    long long high = 0;
+    for (int i=0; i<count; i++){
+        float newred = matrix[0][0] * red[i] + matrix[0][1] * green[i] + matrix[0][2] * blue[i];
+        float newgreen = matrix[1][0] * red[i] + matrix[1][1] * green[i] + matrix[1][2] * blue[i];
+        float newblue = matrix[2][0] * red[i] + matrix[2][1] * green[i] + matrix[2][2] * blue[i];
+        low += (newred < 0.0f) | (newgreen < 0.0f) | (newblue < 0.0f);
+        high += (newred > 1.0f) | (newgreen > 1.0f) | (newblue > 1.0f);
+        red[i] = clampfloat(newred);
+        green[i] = clampfloat(newgreen);
+        blue[i] = clampfloat(newblue);
+    }
+    clips->low += low;
+    clips->high += high;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+
+__attribute__((target("sse2")))
+static void matrixrowsse(const float matrix[3][3], float* red, float* green, float* blue, int count, ntscj_clipcount* clips){
+    __m128 m[3][3];
+    for (int j=0; j<3; j++){
+        for (int k=0; k<3; k++){
+            m[j][k] = _mm_set1_ps(matrix[j][k]);
+        }
+    }
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    long long low = 0;
+    long long high = 0;
+    int i = 0;
+    for (; i+4<=count; i+=4){
+        __m128 r = _mm_loadu_ps(red + i);
+        __m128 g = _mm_loadu_ps(green + i);
+        __m128 b = _mm_loadu_ps(blue + i);
+        __m128 newred = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][0], r), _mm_mul_ps(m[0][1], g)), _mm_mul_ps(m[0][2], b));
+        __m128 newgreen = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[1][0], r), _mm_mul_ps(m[1][1], g)), _mm_mul_ps(m[1][2], b));
+        __m128 newblue = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[2][0], r), _mm_mul_ps(m[2][1], g)), _mm_mul_ps(m[2][2], b));
+        __m128 under = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(newred, zero), _mm_cmplt_ps(newgreen, zero)), _mm_cmplt_ps(newblue, zero));
+        __m128 over = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(newred, one), _mm_cmpgt_ps(newgreen, one)), _mm_cmpgt_ps(newblue, one));
+        low += __builtin_popcount(_mm_movemask_ps(under));
+        high += __builtin_popcount(_mm_movemask_ps(over));
+        _mm_storeu_ps(red + i, _mm_max_ps(_mm_min_ps(newred, one), zero));
+        _mm_storeu_ps(green + i, _mm_max_ps(_mm_min_ps(newgreen, one), zero));
+        _mm_storeu_ps(blue + i, _mm_max_ps(_mm_min_ps(newblue, one), zero));
+    }
+    clips->low += low;
+    clips->high += high;
+    matrixrowscalar(matrix, red + i, green + i, blue + i, count - i, clips);
+}
+
+__attribute__((target("avx2")))
+static void matrixrowavx2(const float matrix[3][3], float* red, float* green, float* blue, int count, ntscj_clipcount* clips){
+    __m256 m[3][3];
+    for (int j=0; j<3; j++){
+        for (int k=0; k<3; k++){
+            m[j][k] = _mm256_set1_ps(matrix[j][k]);
+        }
+    }
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    long long low = 0;
+    long long high = 0;
+    int i = 0;
+    for (; i+8<=count; i+=8){
+        __m256 r = _mm256_loadu_ps(red + i);
+        __m256 g = _mm256_loadu_ps(green + i);
+        __m256 b = _mm256_loadu_ps(blue + i);
+        __m256 newred = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[0][0], r), _mm256_mul_ps(m[0][1], g)), _mm256_mul_ps(m[0][2], b));
+        __m256 newgreen = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[1][0], r), _mm256_mul_ps(m[1][1], g)), _mm256_mul_ps(m[1][2], b));
+        __m256 newblue = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[2][0], r), _mm256_mul_ps(m[2][1], g)), _mm256_mul_ps(m[2][2], b));
+        __m256 under = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(newred, zero, _CMP_LT_OQ), _mm256_cmp_ps(newgreen, zero, _CMP_LT_OQ)), _mm256_cmp_ps(newblue, zero, _CMP_LT_OQ));
+        __m256 over = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(newred, one, _CMP_GT_OQ), _mm256_cmp_ps(newgreen, one, _CMP_GT_OQ)), _mm256_cmp_ps(newblue, one, _CMP_GT_OQ));
+        low += __builtin_popcount(_mm256_movemask_ps(under));
+        high += __builtin_popcount(_mm256_movemask_ps(over));
+        _mm256_storeu_ps(red + i, _mm256_max_ps(_mm256_min_ps(newred, one), zero));
+        _mm256_storeu_ps(green + i, _mm256_max_ps(_mm256_min_ps(newgreen, one), zero));
+        _mm256_storeu_ps(blue + i, _mm256_max_ps(_mm256_min_ps(newblue, one), zero));
+    }
+    clips->low += low;
+    clips->high += high;
+    matrixrowsse(matrix, red + i, green + i, blue + i, count - i, clips);
+}
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+
+static void matrixrowneon(const float matrix[3][3], float* red, float* green, float* blue, int count, ntscj_clipcount* clips){
+    float32x4_t m[3][3];
+    for (int j=0; j<3; j++){
+        for (int k=0; k<3; k++){
+            m[j][k] = vdupq_n_f32(matrix[j][k]);
+        }
+    }
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    // lanes are all ones (-1) when set, so subtracting the masks counts them
+    int32x4_t low = vdupq_n_s32(0);
+    int32x4_t high = vdupq_n_s32(0);
+    int i = 0;
+    for (; i+4<=count; i+=4){
+        float32x4_t r = vld1q_f32(red + i);
+        float32x4_t g = vld1q_f32(green + i);
+        float32x4_t b = vld1q_f32(blue + i);
+        // separate multiplies and adds, not vmlaq/vfmaq, to match the scalar rounding
+        float32x4_t newred = vaddq_f32(vaddq_f32(vmulq_f32(m[0][0], r), vmulq_f32(m[0][1], g)), vmulq_f32(m[0][2], b));
+        float32x4_t newgreen = vaddq_f32(vaddq_f32(vmulq_f32(m[1][0], r), vmulq_f32(m[1][1], g)), vmulq_f32(m[1][2], b));
+        float32x4_t newblue = vaddq_f32(vaddq_f32(vmulq_f32(m[2][0], r), vmulq_f32(m[2][1], g)), vmulq_f32(m[2][2], b));
+        uint32x4_t under = vorrq_u32(vorrq_u32(vcltq_f32(newred, zero), vcltq_f32(newgreen, zero)), vcltq_f32(newblue, zero));
+        uint32x4_t over = vorrq_u32(vorrq_u32(vcgtq_f32(newred, one), vcgtq_f32(newgreen, one)), vcgtq_f32(newblue, one));
+        low = vsubq_s32(low, vreinterpretq_s32_u32(under));
+        high = vsubq_s32(high, vreinterpretq_s32_u32(over));
+        vst1q_f32(red + i, vmaxq_f32(vminq_f32(newred, one), zero));
+        vst1q_f32(green + i, vmaxq_f32(vminq_f32(newgreen, one), zero));
+        vst1q_f32(blue + i, vmaxq_f32(vminq_f32(newblue, one), zero));
+    }
+    clips->low += vgetq_lane_s32(low, 0) + vgetq_lane_s32(low, 1) + vgetq_lane_s32(low, 2) + vgetq_lane_s32(low, 3);
+    clips->high += vgetq_lane_s32(high, 0) + vgetq_lane_s32(high, 1) + vgetq_lane_s32(high, 2) + vgetq_lane_s32(high, 3);
+    matrixrowscalar(matrix, red + i, green + i, blue + i, count - i, clips);
+}
+#endif
+
+// the best kernel this CPU can run, chosen by initmatrixkernel()
+static matrixrowfunction bestmatrixrow = matrixrowscalar;
+static const char* bestmatrixkernelname = "scalar";
+
+static void initmatrixkernel(){
+#if defined(HAVE_X86_KERNELS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        bestmatrixrow = matrixrowavx2;
+        bestmatrixkernelname = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")){
+        bestmatrixrow = matrixrowsse;
+        bestmatrixkernelname = "sse2";
+    }
+#elif defined(HAVE_NEON_KERNELS)
+    bestmatrixrow = matrixrowneon;
+    bestmatrixkernelname = "neon";
+#endif
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+// Fixed-point path
+// Everything per pixel is integer arithmetic, so the output only depends on the tables, not on the compiler, the FPU, or the libm.
+// The tables are built once with pow() and rounded to integers, so libm differences of an ulp or two can't realistically move them.
+// The output is never more than 1 away from the float path, but around 1% of values differ by 1.
+
+// linear values are Q16: 65536 is 1.0
+#define FIXED_ONE 65536
+// matrix coefficients are Q14. The largest row of absolute values (NTSC-J to sRGB red) sums to about 1.7,
+// so a row times a Q16 color stays under 2^31. setfixedmatrices() checks that for every profile.
+#define FIXED_MATRIX_SHIFT 14
+
+static int32_t fixedlineartable[256];
+// linear Q16 to sRGB times 255 in Q8 (0-65280), one entry per linear step, so no interpolation
+static uint16_t fixedgammatable[FIXED_ONE + 1];
+
+// quasirandom sequence steps as fractions of 2^32, so the fractional part just falls out of unsigned wraparound
+#define FIXED_DITHER_X 3242174889u // 0.7548776662 * 2^32
+#define FIXED_DITHER_Y 2447445409u // 0.56984029 * 2^32
+
+static void initfixedtables(){
+    for (int i=0; i<256; i++){
+        fixedlineartable[i] = (int32_t)lround(tolinear(i / 255.0) * FIXED_ONE);
+    }
+    for (int i=0; i<=FIXED_ONE; i++){
+        fixedgammatable[i] = (uint16_t)lround(togamma((double)i / FIXED_ONE) * 255.0 * 256.0);
+    }
+}
+
+// quasirandomdither() in integers. Same sequence and triangle fold, with the dither as Q16.
+static inline uint8_t fixeddither(uint16_t input, uint32_t x, uint32_t y){
+    uint32_t position = (((x + 1) * FIXED_DITHER_X) + ((y + 1) * FIXED_DITHER_Y)) >> 16;
+    uint32_t dither;
+    if (position < 32768){
+        dither = position * 2;
+    }
+    else if (position > 32768){
+        dither = 131072 - (position * 2);
+    }
+    else {
+        // exactly 0.5, same as the float version
+        dither = 32768;
+    }
+    uint32_t output = (((uint32_t)input << 8) + dither) >> 16;
+    if (output > 255) output = 255;
+    return (uint8_t)output;
+}
+
+// multiply one Q16 color by a Q14 matrix row, round back to Q16, and clamp, noting which way it clipped
+static inline int32_t fixedmatrixrow(const int32_t row[3], int32_t red, int32_t green, int32_t blue, int* clipped){
+    int32_t value = ((row[0] * red) + (row[1] * green) + (row[2] * blue) + (1 << (FIXED_MATRIX_SHIFT - 1))) >> FIXED_MATRIX_SHIFT;
+    if (value < 0){
+        *clipped |= CLIPPED_LOW;
+        return 0;
+    }
+    if (value > FIXED_ONE){
+        *clipped |= CLIPPED_HIGH;
+        return FIXED_ONE;
+    }
+    return value;
+}
+
+// Fixed-point version of convertrows(). Doesn't need any scratch space.
+static void fixedconvertrows(uint8_t* rows, size_t stride, const uint8_t* mask, size_t maskstride, int width, int height, int xstart, int xend, int ystart, int yend,
+                             int channels, const ntscj_profile* profile, int mode, bool skiptransparent, ntscj_clipcount* clips){
+    const int32_t (*matrix)[3] = profile->fixedmatrices[(mode == 1) ? 0 : 1];
+    // result for the last color converted, reused for runs of the same color
+    int previous = -1;
+    uint16_t newcolor[3] = {0, 0, 0};
+    int clipped = 0;
+    for (int y=ystart; y<yend; y++){
+        uint8_t *row = &rows[ (size_t)(y - ystart) * stride];
+        const uint8_t *maskrow = (mask != NULL) ? &mask[ (size_t)(y - ystart) * maskstride] : NULL;
+        for (int x=xstart; x<xend; x++){
+            uint8_t *pixel = &row[x * channels];
+            if (skiptransparent && (pixel[3] == 0)) continue;
+            if ((maskrow != NULL) && (maskrow[x] == 0)) continue;
+            int key = (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+            if (key != previous){
+                int32_t red = fixedlineartable[pixel[0]];
+                int32_t green = fixedlineartable[pixel[1]];
+                int32_t blue = fixedlineartable[pixel[2]];
+                clipped = 0;
+                newcolor[0] = fixedgammatable[fixedmatrixrow(matrix[0], red, green, blue, &clipped)];
+                newcolor[1] = fixedgammatable[fixedmatrixrow(matrix[1], red, green, blue, &clipped)];
+                newcolor[2] = fixedgammatable[fixedmatrixrow(matrix[2], red, green, blue, &clipped)];
+                previous = key;
+            }
+            clips->low += (clipped & CLIPPED_LOW) ? 1 : 0;
+            clips->high += (clipped & CLIPPED_HIGH) ? 1 : 0;
+            // same dither coordinate flips as convertrows()
+            pixel[0] = fixeddither(newcolor[0], (uint32_t)(width - x - 1), (uint32_t)y);
+            pixel[1] = fixeddither(newcolor[1], (uint32_t)x, (uint32_t)y);
+            pixel[2] = fixeddither(newcolor[2], (uint32_t)x, (uint32_t)(height - y - 1));
+        }
+    }
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+// Working out a profile's matrices
+// Linear RGB in the profile's gamut to XYZ, Bradford adaptation from its white point to D65, then XYZ to linear sRGB, all in doubles.
+
+// Not const, and neither are the matrix parameters below, since C before C23 won't pass a double[3][3] to a const double[3][3] without a cast.
+static double bradfordmatrix[3][3] = {
+    {0.8951, 0.2664, -0.1614},
+    {-0.7502, 1.7135, 0.0367},
+    {0.0389, -0.0685, 1.0296}
+};
+
+static void multiplymatrices(double a[3][3], double b[3][3], double output[3][3]){
+    for (int i=0; i<3; i++){
+        for (int j=0; j<3; j++){
+            output[i][j] = (a[i][0] * b[0][j]) + (a[i][1] * b[1][j]) + (a[i][2] * b[2][j]);
+        }
+    }
+}
+
+static void multiplyvector(double matrix[3][3], const double vector[3], double output[3]){
+    for (int i=0; i<3; i++){
+        output[i] = (matrix[i][0] * vector[0]) + (matrix[i][1] * vector[1]) + (matrix[i][2] * vector[2]);
+    }
+}
+
+// Returns false if the matrix is singular.
+static bool invertmatrix(double matrix[3][3], double output[3][3]){
+    double cofactor[3][3];
+    for (int i=0; i<3; i++){
+        for (int j=0; j<3; j++){
+            int i1 = (i + 1) % 3, i2 = (i + 2) % 3, j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+            cofactor[i][j] = (matrix[i1][j1] * matrix[i2][j2]) - (matrix[i1][j2] * matrix[i2][j1]);
+        }
+    }
+    double determinant = (matrix[0][0] * cofactor[0][0]) + (matrix[0][1] * cofactor[0][1]) + (matrix[0][2] * cofactor[0][2]);
+    if (!(fabs(determinant) > 1e-12)) return false;
+    for (int i=0; i<3; i++){
+        for (int j=0; j<3; j++){
+            output[i][j] = cofactor[j][i] / determinant;
+        }
+    }
+    return true;
+}
+
+// XYZ of a chromaticity at Y = 1. Returns false for one that can't be a color.
+static bool chromaticitytoxyz(const double xy[2], double output[3]){
+    if (!(xy[1] > 0.0) || !(xy[0] >= 0.0) || !(xy[0] + xy[1] <= 1.0)) return false;
+    output[0] = xy[0] / xy[1];
+    output[1] = 1.0;
+    output[2] = (1.0 - xy[0] - xy[1]) / xy[1];
+    return true;
+}
+
+// linear RGB to XYZ, scaled so the white point comes out at Y = 1
+static bool gamuttoxyzmatrix(const ntscj_gamut* gamut, double output[3][3]){
+    const double* primaries[3] = {gamut->red, gamut->green, gamut->blue};
+    double white[3];
+    double unscaled[3][3];
+    double inverse[3][3];
+    double scale[3];
+    for (int j=0; j<3; j++){
+        double primary[3];
+        if (!chromaticitytoxyz(primaries[j], primary)) return false;
+        for (int i=0; i<3; i++){
+            unscaled[i][j] = primary[i];
+        }
+    }
+    if (!chromaticitytoxyz(gamut->white, white) || !invertmatrix(unscaled, inverse)) return false;
+    multiplyvector(inverse, white, scale);
+    for (int i=0; i<3; i++){
+        for (int j=0; j<3; j++){
+            output[i][j] = unscaled[i][j] * scale[j];
+        }
+    }
+    return true;
+}
+
+// XYZ under one white point to XYZ under another
+static bool bradfordadaptation(const double from[2], const double to[2], double output[3][3]){
+    double fromxyz[3], toxyz[3], fromcone[3], tocone[3], inverse[3][3];
+    if (!chromaticitytoxyz(from, fromxyz) || !chromaticitytoxyz(to, toxyz) || !invertmatrix(bradfordmatrix, inverse)) return false;
+    multiplyvector(bradfordmatrix, fromxyz, fromcone);
+    multiplyvector(bradfordmatrix, toxyz, tocone);
+    double scaled[3][3];
+    for (int i=0; i<3; i++){
+        for (int j=0; j<3; j++){
+            scaled[i][j] = bradfordmatrix[i][j] * (tocone[i] / fromcone[i]);
+        }
+    }
+    multiplymatrices(inverse, scaled, output);
+    return true;
+}
+
+// The gamut to sRGB matrix for a gamut, not yet rounded to float.
+static bool computegamutmatrix(const ntscj_gamut* gamut, double output[3][3]){
+    double source[3][3], destination[3][3], fromxyz[3][3], adaptation[3][3], adapted[3][3];
+    if (!gamuttoxyzmatrix(gamut, source) || !gamuttoxyzmatrix(&srgbgamut, destination) || !invertmatrix(destination, fromxyz)) return false;
+    if (!bradfordadaptation(gamut->white, srgbgamut.white, adaptation)) return false;
+    multiplymatrices(adaptation, source, adapted);
+    multiplymatrices(fromxyz, adapted, output);
+    return true;
+}
+
+// Round a profile's float matrices to Q14. Returns false if a row could overflow the fixed-point path:
+// its positive or its negative coefficients times a full scale Q16 color, plus the rounding, have to fit in 32 bits.
+static bool setfixedmatrices(ntscj_profile* profile){
+    for (int m=0; m<2; m++){
+        for (int i=0; i<3; i++){
+            int64_t positive = 0;
+            int64_t negative = 0;
+            for (int j=0; j<3; j++){
+                float value = profile->matrices[m][i][j];
+                if (!(fabsf(value) < 2.0f)) return false;
+                int32_t coefficient = (int32_t)lround(value * (1 << FIXED_MATRIX_SHIFT));
+                profile->fixedmatrices[m][i][j] = coefficient;
+                if (coefficient > 0){
+                    positive += coefficient;
+                }
+                else {
+                    negative += coefficient;
+                }
+            }
+            if ((positive * FIXED_ONE) + (1 << (FIXED_MATRIX_SHIFT - 1)) > INT32_MAX) return false;
+            if ((negative * FIXED_ONE) < INT32_MIN) return false;
+        }
+    }
+    return true;
+}
+
+// Fill in both of a profile's matrices from its gamut. Returns false if the gamut is degenerate or too far from sRGB for the fixed-point path.
+static bool computeprofile(ntscj_profile* profile){
+    double forward[3][3], backward[3][3];
+    if (!computegamutmatrix(&profile->gamut, forward) || !invertmatrix(forward, backward)) return false;
+    for (int i=0; i<3; i++){
+        for (int j=0; j<3; j++){
+            profile->matrices[0][i][j] = (float)forward[i][j];
+            profile->matrices[1][i][j] = (float)backward[i][j];
+        }
+    }
+    return setfixedmatrices(profile);
+}
+
+static void initprofiles(){
+    memcpy(DEFAULT_PROFILE->matrices[0], NTSCJtoSRGBConversionMatrix, sizeof NTSCJtoSRGBConversionMatrix);
+    memcpy(DEFAULT_PROFILE->matrices[1], SRGBtoNTSCJConversionMatrix, sizeof SRGBtoNTSCJConversionMatrix);
+    setfixedmatrices(DEFAULT_PROFILE);
+    for (int i=1; i<BUILTIN_PROFILES; i++){
+        computeprofile(&builtinprofiles[i]);
+    }
+}
+
+static ntscj_profile* addedprofiles = NULL;
+static pthread_mutex_t profilelock = PTHREAD_MUTEX_INITIALIZER;
+
+// caller holds profilelock
+static ntscj_profile* findprofile(const char* name){
+    for (int i=0; i<BUILTIN_PROFILES; i++){
+        if (strcmp(builtinprofiles[i].name, name) == 0) return &builtinprofiles[i];
+    }
+    for (ntscj_profile* profile = addedprofiles; profile != NULL; profile = profile->next){
+        if (strcmp(profile->name, name) == 0) return profile;
+    }
+    return NULL;
+}
+
+const ntscj_profile* ntscj_find_profile(const char* name){
+    ntscj_init();
+    pthread_mutex_lock(&profilelock);
+    const ntscj_profile* profile = findprofile(name);
+    pthread_mutex_unlock(&profilelock);
+    return profile;
+}
+
+const ntscj_profile* ntscj_add_profile(const char* name, const ntscj_gamut* gamut){
+    ntscj_init();
+    pthread_mutex_lock(&profilelock);
+    ntscj_profile* profile = findprofile(name);
+    if (profile != NULL){
+        if (memcmp(&profile->gamut, gamut, sizeof(ntscj_gamut)) != 0) profile = NULL;
+        pthread_mutex_unlock(&profilelock);
+        return profile;
+    }
+    size_t namesize = strlen(name) + 1;
+    profile = calloc(1, sizeof(ntscj_profile) + namesize);
+    if (profile != NULL){
+        char* copy = (char*)(profile + 1);
+        memcpy(copy, name, namesize);
+        profile->name = copy;
+        profile->gamut = *gamut;
+        if (computeprofile(profile)){
+            profile->next = addedprofiles;
+            addedprofiles = profile;
+        }
+        else {
+            free(profile);
+            profile = NULL;
+        }
+    }
+    pthread_mutex_unlock(&profilelock);
+    return profile;
+}
+
+const char* ntscj_profile_name(const ntscj_profile* profile){
+    return (profile != NULL) ? profile->name : DEFAULT_PROFILE->name;
+}
+
+const ntscj_gamut* ntscj_profile_gamut(const ntscj_profile* profile){
+    return (profile != NULL) ? &profile->gamut : &DEFAULT_PROFILE->gamut;
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+// 3D LUTs
+// Either the conversion sampled on a grid, for shaders and video tools to apply with one texture lookup,
+// or a LUT from elsewhere used in place of the gamut conversion.
+
+struct ntscj_lut {
+    int size; // grid points per axis
+    float* values; // size^3 sRGB colors, 0-1, red changing fastest, then green, then blue (the .cube order)
+};
+
+ntscj_lut* ntscj_create_lut(int size, const float* values){
+    if ((size < 2) || (size > NTSCJ_MAX_LUT_SIZE)) return NULL;
+    ntscj_lut* lut = malloc(sizeof(ntscj_lut));
+    if (lut == NULL) return NULL;
+    size_t count = (size_t)size * size * size * 3;
+    lut->size = size;
+    lut->values = malloc(count * sizeof(float));
+    if (lut->values == NULL){
+        free(lut);
+        return NULL;
+    }
+    for (size_t i=0; i<count; i++){
+        lut->values[i] = clampfloat(values[i]);
+    }
+    return lut;
+}
+
+ntscj_lut* ntscj_make_lut(int size, ntscj_direction direction, const ntscj_options* options){
+    ntscj_init();
+    ntscj_options defaults;
+    if (options == NULL){
+        ntscj_default_options(&defaults);
+        options = &defaults;
+    }
+    pipeline pipe;
+    makepipeline(options, &pipe);
+    if ((size < 2) || (size > NTSCJ_MAX_LUT_SIZE)) return NULL;
+    ntscj_lut* lut = malloc(sizeof(ntscj_lut));
+    if (lut == NULL) return NULL;
+    lut->size = size;
+    lut->values = malloc((size_t)size * size * size * 3 * sizeof(float));
+    if (lut->values == NULL){
+        free(lut);
+        return NULL;
+    }
+    // decode each grid coordinate the same way initlineartable() does it, so a 256 point LUT matches the 8-bit path exactly
+    float linear[NTSCJ_MAX_LUT_SIZE];
+    for (int i=0; i<size; i++){
+        linear[i] = pipe.decode->tolinear(i / (double)(size - 1));
+    }
+    float* value = lut->values;
+    for (int b=0; b<size; b++){
+        for (int g=0; g<size; g++){
+            for (int r=0; r<size; r++){
+                convertlinearcolor(linear[r], linear[g], linear[b], &pipe, (int)direction, value);
+                value += 3;
+            }
+        }
+    }
+    return lut;
+}
+
+int ntscj_lut_size(const ntscj_lut* lut){
+    return lut->size;
+}
+
+const float* ntscj_lut_values(const ntscj_lut* lut){
+    return lut->values;
+}
+
+void ntscj_free_lut(ntscj_lut* lut){
+    if (lut == NULL) return;
+    free(lut->values);
+    free(lut);
+}
+
+// Where each 8-bit input value falls on a LUT's grid: the grid point at or below it, the step to the next one
+// (0 at the top end, so an input right on a grid point never touches its neighbor), and how far along it is.
+typedef struct lutaxis {
+    int base[256];
+    int next[256];
+    float fraction[256];
+} lutaxis;
+
+static void initlutaxis(lutaxis* axis, int size, int stride){
+    for (int c=0; c<256; c++){
+        double position = (c * (size - 1)) / 255.0;
+        int base = (int)position;
+        if (base > size - 1) base = size - 1;
+        axis->base[c] = base * stride;
+        axis->next[c] = (base < size - 1) ? stride : 0;
+        axis->fraction[c] = (float)(position - base);
+    }
+}
+
+// Interpolate one color from the LUT, tetrahedrally or trilinearly.
+// Tetrahedral only blends the 4 corners of the tetrahedron the color is in, which is faster and keeps the gray axis exact.
+static inline void lutlookup(const float* values, const lutaxis axes[3], bool trilinear, uint8_t red, uint8_t green, uint8_t blue, float output[3]){
+    const float* c000 = &values[axes[0].base[red] + axes[1].base[green] + axes[2].base[blue]];
+    int dr = axes[0].next[red];
+    int dg = axes[1].next[green];
+    int db = axes[2].next[blue];
+    float fr = axes[0].fraction[red];
+    float fg = axes[1].fraction[green];
+    float fb = axes[2].fraction[blue];
+    const float* c111 = c000 + dr + dg + db;
+    for (int c=0; c<3; c++){
+        if (trilinear){
+            float c00 = c000[c] + ((c000[c + dr] - c000[c]) * fr);
+            float c10 = c000[c + dg] + ((c000[c + dg + dr] - c000[c + dg]) * fr);
+            float c01 = c000[c + db] + ((c000[c + db + dr] - c000[c + db]) * fr);
+            float c11 = c000[c + db + dg] + ((c111[c] - c000[c + db + dg]) * fr);
+            float c0 = c00 + ((c10 - c00) * fg);
+            float c1 = c01 + ((c11 - c01) * fg);
+            output[c] = c0 + ((c1 - c0) * fb);
+        }
+        else if (fr > fg){
+            if (fg > fb){
+                output[c] = c000[c] + (fr * (c000[c + dr] - c000[c])) + (fg * (c000[c + dr + dg] - c000[c + dr])) + (fb * (c111[c] - c000[c + dr + dg]));
+            }
+            else if (fr > fb){
+                output[c] = c000[c] + (fr * (c000[c + dr] - c000[c])) + (fb * (c000[c + dr + db] - c000[c + dr])) + (fg * (c111[c] - c000[c + dr + db]));
+            }
+            else {
+                output[c] = c000[c] + (fb * (c000[c + db] - c000[c])) + (fr * (c000[c + db + dr] - c000[c + db])) + (fg * (c111[c] - c000[c + db + dr]));
+            }
+        }
+        else {
+            if (fb > fg){
+                output[c] = c000[c] + (fb * (c000[c + db] - c000[c])) + (fg * (c000[c + db + dg] - c000[c + db])) + (fr * (c111[c] - c000[c + db + dg]));
+            }
+            else if (fb > fr){
+                output[c] = c000[c] + (fg * (c000[c + dg] - c000[c])) + (fb * (c000[c + dg + db] - c000[c + dg])) + (fr * (c111[c] - c000[c + dg + db]));
+            }
+            else {
+                output[c] = c000[c] + (fg * (c000[c + dg] - c000[c])) + (fr * (c000[c + dg + dr] - c000[c + dg])) + (fb * (c111[c] - c000[c + dg + dr]));
+            }
+        }
+        output[c] = clampfloat(output[c]);
+    }
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+// OpenCL backend
+// Only built with -DNTSCJ_WITH_OPENCL (and -lOpenCL). The kernel runs the fixed-point pipeline above, with the same tables,
+// because GPUs aren't required to do double precision at all, let alone round it the same way as the CPU.
+// So the output is bit for bit the same as the CPU fixed-point path, and falling back to the CPU
+// (no device, or any OpenCL error) doesn't change a single pixel.
+
+#ifdef NTSCJ_WITH_OPENCL
+
+#define CL_TARGET_OPENCL_VERSION 120
+#include <CL/cl.h>
+
+static const char* gpukernelsource =
+"uchar fixeddither(uint input, uint x, uint y){\n"
+"    uint position = (((x + 1) * 3242174889u) + ((y + 1) * 2447445409u)) >> 16;\n"
+"    uint dither = (position < 32768) ? (position * 2) : ((position > 32768) ? (131072 - (position * 2)) : 32768);\n"
+"    uint output = ((input << 8) + dither) >> 16;\n"
+"    return (uchar)min(output, 255u);\n"
+"}\n"
+"__kernel void convert(__global uchar* pixels, int width, int height, int ystart, int skiptransparent,\n"
+"                      __constant int* lineartable, __global const ushort* gammatable, __constant int* matrix, __global uint* clips){\n"
+"    int x = get_global_id(0);\n"
+"    int row = get_global_id(1);\n"
+"    int y = ystart + row;\n"
+"    __global uchar* pixel = pixels + ((((size_t)row * width) + x) * 4);\n"
+"    if (skiptransparent && (pixel[3] == 0)) return;\n"
+"    int red = lineartable[pixel[0]];\n"
+"    int green = lineartable[pixel[1]];\n"
+"    int blue = lineartable[pixel[2]];\n"
+"    int clipped = 0;\n"
+"    uint newcolor[3];\n"
+"    for (int c=0; c<3; c++){\n"
+"        int value = ((matrix[(c * 3)] * red) + (matrix[(c * 3) + 1] * green) + (matrix[(c * 3) + 2] * blue) + 8192) >> 14;\n"
+"        if (value < 0){ clipped |= 1; value = 0; }\n"
+"        if (value > 65536){ clipped |= 2; value = 65536; }\n"
+"        newcolor[c] = gammatable[value];\n"
+"    }\n"
+"    if (clipped & 1) atomic_inc(&clips[0]);\n"
+"    if (clipped & 2) atomic_inc(&clips[1]);\n"
+"    pixel[0] = fixeddither(newcolor[0], width - x - 1, y);\n"
+"    pixel[1] = fixeddither(newcolor[1], x, y);\n"
+"    pixel[2] = fixeddither(newcolor[2], x, height - y - 1);\n"
+"}\n";
+
+// Everything that stays on the device from one call to the next: the compiled kernel, the tables, and the pixel buffer.
+typedef struct gpubackend {
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+    cl_mem lineartable;
+    cl_mem gammatable;
+    cl_mem matrices[2];
+    cl_mem clips;
+    cl_mem pixels;
+    size_t pixelcapacity; // bytes
+} gpubackend;
+
+static void freegpubackend(gpubackend* gpu){
+    if (gpu == NULL) return;
+    if (gpu->pixels != NULL) clReleaseMemObject(gpu->pixels);
+    if (gpu->clips != NULL) clReleaseMemObject(gpu->clips);
+    for (int i=0; i<2; i++){
+        if (gpu->matrices[i] != NULL) clReleaseMemObject(gpu->matrices[i]);
+    }
+    if (gpu->gammatable != NULL) clReleaseMemObject(gpu->gammatable);
+    if (gpu->lineartable != NULL) clReleaseMemObject(gpu->lineartable);
+    if (gpu->kernel != NULL) clReleaseKernel(gpu->kernel);
+    if (gpu->program != NULL) clReleaseProgram(gpu->program);
+    if (gpu->queue != NULL) clReleaseCommandQueue(gpu->queue);
+    if (gpu->context != NULL) clReleaseContext(gpu->context);
+    free(gpu);
+}
+
+// Set up the first GPU on the first platform that has one. Returns NULL if there isn't one or anything goes wrong.
+static gpubackend* creategpubackend(const ntscj_profile* profile){
+    cl_platform_id platforms[8];
+    cl_uint platformcount = 0;
+    if ((clGetPlatformIDs(8, platforms, &platformcount) != CL_SUCCESS) || (platformcount == 0)) return NULL;
+    if (platformcount > 8) platformcount = 8;
+    cl_device_id device = NULL;
+    for (cl_uint i=0; (i<platformcount) && (device == NULL); i++){
+        cl_uint devicecount = 0;
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1, &device, &devicecount) != CL_SUCCESS){
+            device = NULL;
+        }
+    }
+    if (device == NULL) return NULL;
+    
+    gpubackend* gpu = calloc(1, sizeof(gpubackend));
+    if (gpu == NULL) return NULL;
+    cl_int status;
+    gpu->context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+    if (status != CL_SUCCESS) goto fail;
+    gpu->queue = clCreateCommandQueue(gpu->context, device, 0, &status);
+    if (status != CL_SUCCESS) goto fail;
+    gpu->program = clCreateProgramWithSource(gpu->context, 1, &gpukernelsource, NULL, &status);
+    if (status != CL_SUCCESS) goto fail;
+    if (clBuildProgram(gpu->program, 1, &device, "", NULL, NULL) != CL_SUCCESS) goto fail;
+    gpu->kernel = clCreateKernel(gpu->program, "convert", &status);
+    if (status != CL_SUCCESS) goto fail;
+    
+    // the tables never change, so they go up once
+    gpu->lineartable = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof fixedlineartable, fixedlineartable, &status);
+    if (status != CL_SUCCESS) goto fail;
+    gpu->gammatable = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof fixedgammatable, fixedgammatable, &status);
+    if (status != CL_SUCCESS) goto fail;
+    for (int i=0; i<2; i++){
+        gpu->matrices[i] = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof profile->fixedmatrices[i], (void*)profile->fixedmatrices[i], &status);
+        if (status != CL_SUCCESS) goto fail;
+    }
+    gpu->clips = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, 2 * sizeof(cl_uint), NULL, &status);
+    if (status != CL_SUCCESS) goto fail;
+    return gpu;
+    
+fail:
+    freegpubackend(gpu);
+    return NULL;
+}
+
+// Convert rows on the device. Returns false, with the rows untouched, if anything goes wrong, so the caller can do them on the CPU.
+static bool gpuconvertrows(gpubackend* gpu, uint8_t* rows, size_t stride, int width, int height, int ystart, int rowcount, int mode, bool skiptransparent, ntscj_clipcount* clips){
+    size_t rowbytes = (size_t)width * 4;
+    size_t bytes = rowbytes * rowcount;
+    if (bytes > gpu->pixelcapacity){
+        if (gpu->pixels != NULL) clReleaseMemObject(gpu->pixels);
+        gpu->pixelcapacity = 0;
+        cl_int status;
+        gpu->pixels = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, bytes, NULL, &status);
+        if (status != CL_SUCCESS){
+            gpu->pixels = NULL;
+            return false;
+        }
+        gpu->pixelcapacity = bytes;
+    }
+    
+    // the device buffer is tightly packed; the host rows may not be
+    size_t origin[3] = {0, 0, 0};
+    size_t region[3] = {rowbytes, (size_t)rowcount, 1};
+    cl_uint zero[2] = {0, 0};
+    cl_int direction = (mode == 1) ? 0 : 1;
+    cl_int skip = skiptransparent ? 1 : 0;
+    cl_int start = ystart;
+    cl_int widtharg = width;
+    cl_int heightarg = height;
+    bool ok = (clEnqueueWriteBufferRect(gpu->queue, gpu->pixels, CL_FALSE, origin, origin, region, rowbytes, 0, stride, 0, rows, 0, NULL, NULL) == CL_SUCCESS);
+    ok = ok && (clEnqueueWriteBuffer(gpu->queue, gpu->clips, CL_FALSE, 0, sizeof zero, zero, 0, NULL, NULL) == CL_SUCCESS);
+    ok = ok && (clSetKernelArg(gpu->kernel, 0, sizeof(cl_mem), &gpu->pixels) == CL_SUCCESS);
+    ok = ok && (clSetKernelArg(gpu->kernel, 1, sizeof(cl_int), &widtharg) == CL_SUCCESS);
+    ok = ok && (clSetKernelArg(gpu->kernel, 2, sizeof(cl_int), &heightarg) == CL_SUCCESS);
+    ok = ok && (clSetKernelArg(gpu->kernel, 3, sizeof(cl_int), &start) == CL_SUCCESS);
+    ok = ok && (clSetKernelArg(gpu->kernel, 4, sizeof(cl_int), &skip) == CL_SUCCESS);
+    ok = ok && (clSetKernelArg(gpu->kernel, 5, sizeof(cl_mem), &gpu->lineartable) == CL_SUCCESS);
+    ok = ok && (clSetKernelArg(gpu->kernel, 6, sizeof(cl_mem), &gpu->gammatable) == CL_SUCCESS);
+    ok = ok && (clSetKernelArg(gpu->kernel, 7, sizeof(cl_mem), &gpu->matrices[direction]) == CL_SUCCESS);
+    ok = ok && (clSetKernelArg(gpu->kernel, 8, sizeof(cl_mem), &gpu->clips) == CL_SUCCESS);
+    size_t global[2] = {(size_t)width, (size_t)rowcount};
+    ok = ok && (clEnqueueNDRangeKernel(gpu->queue, gpu->kernel, 2, NULL, global, NULL, 0, NULL, NULL) == CL_SUCCESS);
+    // read into a temporary first, so that a failure part way through never leaves half converted rows behind
+    uint8_t* converted = ok ? malloc(bytes) : NULL;
+    cl_uint counts[2] = {0, 0};
+    ok = ok && (converted != NULL);
+    ok = ok && (clEnqueueReadBuffer(gpu->queue, gpu->pixels, CL_TRUE, 0, bytes, converted, 0, NULL, NULL) == CL_SUCCESS);
+    ok = ok && (clEnqueueReadBuffer(gpu->queue, gpu->clips, CL_TRUE, 0, sizeof counts, counts, 0, NULL, NULL) == CL_SUCCESS);
+    if (ok){
+        for (int y=0; y<rowcount; y++){
+            memcpy(&rows[(size_t)y * stride], &converted[(size_t)y * rowbytes], rowbytes);
+        }
+        clips->low += counts[0];
+        clips->high += counts[1];
+    }
+    else {
+        clFinish(gpu->queue);
+    }
+    free(converted);
+    return ok;
+}
+
+#endif /* NTSCJ_WITH_OPENCL */
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+// Contexts and the conversion loop
+
+// Scratch space for one conversion thread.
+typedef struct threadspace {
+    bool usememo;
+    colormemo memo;
+    float* rowbuffer; // red, green, and blue arrays for one row, rowcapacity floats each
+    int* rowpositions; // which column each rowbuffer entry came from, when transparent pixels are left out
+    int rowcapacity;
+    double* dithertable; // dithercolumnterm() for x from 0 to dithercapacity-1
+    int dithercapacity;
+    ntscj_clipcount clips; // since the last reset
+} threadspace;
+
+struct ntscj_context {
+    ntscj_options options;
+    pipeline pipeline; // what the options pick for the float path
+    matrixrowfunction matrixrow;
+    threadspace* spaces; // one per thread so the threads never have to share
+#ifdef NTSCJ_WITH_OPENCL
+    gpubackend* gpu; // NULL unless the gpu option is set and there's a device
+#endif
+    lutaxis* lutaxes; // red, green, and blue, when the lut option is set
+};
+
+static pthread_once_t initonce = PTHREAD_ONCE_INIT;
+
+static void initonce_tables(){
+    preparetransfer(&transfers[NTSCJ_TRANSFER_SRGB], true, true, false);
+    initmatrixkernel();
+    initfixedtables();
+    initprofiles();
+}
+
+void ntscj_init(void){
+    pthread_once(&initonce, initonce_tables);
+}
+
+void ntscj_default_options(ntscj_options* options){
+    options->threads = 1;
+    options->memo = false;
+    options->exact = false;
+    options->simd = true;
+    options->fixed = false;
+    options->skiptransparent = false;
+    options->gpu = false;
+    options->lut = NULL;
+    options->trilinear = false;
+    options->profile = NULL;
+    options->decode = NTSCJ_TRANSFER_SRGB;
+    options->encode = NTSCJ_TRANSFER_SRGB;
+}
+
+// the fixed-point tables are sRGB only
+static bool srgbtransfers(const ntscj_options* options){
+    return (validtransfer(options->decode) == NTSCJ_TRANSFER_SRGB) && (validtransfer(options->encode) == NTSCJ_TRANSFER_SRGB);
+}
+
+const char* ntscj_kernel_name(const ntscj_options* options){
+    ntscj_init();
+#ifdef NTSCJ_WITH_OPENCL
+    if ((options != NULL) && options->gpu && (options->lut == NULL) && srgbtransfers(options)) return "opencl";
+#endif
+    if ((options != NULL) && (options->lut != NULL)) return options->trilinear ? "trilinear lut" : "tetrahedral lut";
+    if ((options != NULL) && (options->fixed || options->gpu) && srgbtransfers(options)) return "fixed";
+    if ((options != NULL) && !options->simd) return "scalar";
+    return bestmatrixkernelname;
+}
+
+ntscj_context* ntscj_create_context(const ntscj_options* options){
+    ntscj_init();
+    ntscj_context* context = calloc(1, sizeof(ntscj_context));
+    if (context == NULL) return NULL;
+    if (options != NULL){
+        context->options = *options;
+    }
+    else {
+        ntscj_default_options(&context->options);
+    }
+    if (context->options.threads < 1) context->options.threads = 1;
+    if (context->options.threads > NTSCJ_MAX_THREADS) context->options.threads = NTSCJ_MAX_THREADS;
+    if (context->options.profile == NULL) context->options.profile = DEFAULT_PROFILE;
+    // the gpu runs the fixed-point pipeline, and so does the cpu whenever the gpu can't. A LUT replaces both.
+    if (context->options.lut != NULL){
+        context->options.gpu = false;
+        context->options.fixed = false;
+        context->options.memo = false;
+    }
+    if (!srgbtransfers(&context->options)){
+        context->options.gpu = false;
+        context->options.fixed = false;
+    }
+    if (context->options.gpu) context->options.fixed = true;
+    makepipeline(&context->options, &context->pipeline);
+    context->matrixrow = context->options.simd ? bestmatrixrow : matrixrowscalar;
+    context->spaces = calloc(context->options.threads, sizeof(threadspace));
+    if (context->spaces == NULL){
+        free(context);
+        return NULL;
+    }
+    if (context->options.lut != NULL){
+        int size = context->options.lut->size;
+        context->lutaxes = malloc(3 * sizeof(lutaxis));
+        if (context->lutaxes == NULL){
+            ntscj_free_context(context);
+            return NULL;
+        }
+        initlutaxis(&context->lutaxes[0], size, 3);
+        initlutaxis(&context->lutaxes[1], size, size * 3);
+        initlutaxis(&context->lutaxes[2], size, size * size * 3);
+    }
+    // the memo holds float results, so it's no use to the fixed-point path
+    if (context->options.memo && !context->options.fixed){
+        for (int i=0; i<context->options.threads; i++){
+            context->spaces[i].usememo = initcolormemo(&context->spaces[i].memo, MEMO_INITIAL_SIZE);
+            if (!context->spaces[i].usememo){
+                ntscj_free_context(context);
+                return NULL;
+            }
+        }
+    }
+#ifdef NTSCJ_WITH_OPENCL
+    if (context->options.gpu){
+        context->gpu = creategpubackend(context->options.profile);
+    }
+#endif
+    return context;
+}
+
+bool ntscj_context_uses_gpu(const ntscj_context* context){
+#ifdef NTSCJ_WITH_OPENCL
+    return (context->gpu != NULL);
+#else
+    (void)context;
+    return false;
+#endif
+}
+
+void ntscj_free_context(ntscj_context* context){
+    if (context == NULL) return;
+    for (int i=0; i<context->options.threads; i++){
+        if (context->spaces[i].usememo){
+            freecolormemo(&context->spaces[i].memo);
+        }
+        free(context->spaces[i].rowbuffer);
+        free(context->spaces[i].rowpositions);
+        free(context->spaces[i].dithertable);
+    }
+#ifdef NTSCJ_WITH_OPENCL
+    freegpubackend(context->gpu);
+#endif
+    free(context->lutaxes);
+    free(context->spaces);
+    free(context);
+}
+
+// Make sure the thread's row buffer holds at least width pixels. Only ever grows.
+static bool reserverowbuffer(threadspace* ts, int width){
+    if (width <= ts->rowcapacity) return true;
+    float* newbuffer = realloc(ts->rowbuffer, (size_t)width * 3 * sizeof(float));
+    if (newbuffer == NULL) return false;
+    ts->rowbuffer = newbuffer;
+    int* newpositions = realloc(ts->rowpositions, (size_t)width * sizeof(int));
+    if (newpositions == NULL) return false;
+    ts->rowpositions = newpositions;
+    ts->rowcapacity = width;
+    return true;
+}
+
+// true if every pixel in the row has alpha 0
+static bool rowistransparent(const uint8_t* row, int width){
+    for (int x=0; x<width; x++){
+        if (row[(x * 4) + 3] != 0) return false;
+    }
+    return true;
+}
+
+// true if the mask is 0 for the whole row
+static bool rowisunmasked(const uint8_t* maskrow, int width){
+    for (int x=0; x<width; x++){
+        if (maskrow[x] != 0) return false;
+    }
+    return true;
+}
+
+// Make sure the thread's dither table covers at least width columns. Only ever grows, and the existing entries don't change.
+static bool reservedithertable(threadspace* ts, int width){
+    if (width <= ts->dithercapacity) return true;
+    double* newtable = realloc(ts->dithertable, (size_t)width * sizeof(double));
+    if (newtable == NULL) return false;
+    for (int x=ts->dithercapacity; x<width; x++){
+        newtable[x] = dithercolumnterm(x);
+    }
+    ts->dithertable = newtable;
+    ts->dithercapacity = width;
+    return true;
+}
+
+// convertrows() with the context's LUT instead of the gamut conversion. The LUT has already been clamped, so nothing counts as clipped.
+static void lutconvertrows(const ntscj_context* context, threadspace* ts, uint8_t* rows, size_t stride, const uint8_t* mask, size_t maskstride, int width, int height, int xstart, int xend, int ystart, int yend, int channels){
+    const float* values = context->options.lut->values;
+    bool trilinear = context->options.trilinear;
+    bool skiptransparent = context->options.skiptransparent && (channels == 4);
+    bool dithertable = reservedithertable(ts, width);
+    const double* columns = ts->dithertable;
+    int previous = -1;
+    float newcolor[3] = {0.0, 0.0, 0.0};
+    for (int y=ystart; y<yend; y++){
+        uint8_t *row = &rows[ (size_t)(y - ystart) * stride];
+        const uint8_t *maskrow = (mask != NULL) ? &mask[ (size_t)(y - ystart) * maskstride] : NULL;
+        double rowterm = ditherrowterm(y);
+        double flippedrowterm = ditherrowterm(height - y - 1);
+        for (int x=xstart; x<xend; x++){
+            uint8_t *pixel = &row[x * channels];
+            if (skiptransparent && (pixel[3] == 0)) continue;
+            if ((maskrow != NULL) && (maskrow[x] == 0)) continue;
+            int key = (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+            if (key != previous){
+                lutlookup(values, context->lutaxes, trilinear, pixel[0], pixel[1], pixel[2], newcolor);
+                previous = key;
+            }
+            if (dithertable){
+                pixel[0] = applydither(newcolor[0], tabledither(columns[width - x - 1], rowterm));
+                pixel[1] = applydither(newcolor[1], tabledither(columns[x], rowterm));
+                pixel[2] = applydither(newcolor[2], tabledither(columns[x], flippedrowterm));
+            }
+            else {
+                pixel[0] = quasirandomdither(newcolor[0], width - x - 1, y);
+                pixel[1] = quasirandomdither(newcolor[1], x, y);
+                pixel[2] = quasirandomdither(newcolor[2], x, height - y - 1);
+            }
+        }
+    }
+}
+
+// Gamut convert columns xstart through xend-1 of rows ystart through yend-1 of an 8-bit RGBA (channels 4) or RGB (channels 3) image in place.
+// rows points at column 0 of row ystart, not at the top of the image; width and height are the size of the whole image.
+// If mask isn't NULL, it's one byte per pixel, laid out the same way, and only pixels where it isn't 0 are converted.
+// RGB pixels have no alpha, so skiptransparent doesn't apply to them.
+static void convertrows(const ntscj_context* context, threadspace* ts, uint8_t* rows, size_t stride, const uint8_t* mask, size_t maskstride, int width, int height, int xstart, int xend, int ystart, int yend, int channels, int mode){
+    bool skiptransparent = context->options.skiptransparent && (channels == 4);
+    if (context->options.lut != NULL){
+        lutconvertrows(context, ts, rows, stride, mask, maskstride, width, height, xstart, xend, ystart, yend, channels);
+        return;
+    }
+    if (context->options.fixed){
+        fixedconvertrows(rows, stride, mask, maskstride, width, height, xstart, xend, ystart, yend, channels, context->options.profile, mode, skiptransparent, &ts->clips);
+        return;
+    }
+    const pipeline* pipe = &context->pipeline;
+    const float (*matrix)[3] = pipe->profile->matrices[(mode == 1) ? 0 : 1];
+    const float* lineartable = pipe->decode->lineartable;
+    // the memo works pixel by pixel; otherwise go a row at a time through the matrix kernel.
+    // if we can't get a row buffer, the pixel by pixel path still works.
+    int span = xend - xstart;
+    bool rowkernel = !ts->usememo && reserverowbuffer(ts, span);
+    float* red = ts->rowbuffer;
+    float* green = red + span;
+    float* blue = green + span;
+    const int* positions = ts->rowpositions;
+    // likewise, without a dither table fall back to working out the dither from scratch
+    bool dithertable = reservedithertable(ts, width);
+    const double* columns = ts->dithertable;
+    // in the pixel by pixel paths, the result for the last color converted, reused for runs of the same color.
+    // (The row kernel is cheap enough per pixel that looking for runs doesn't pay.)
+    int previous = -1;
+    float previouscolor[3] = {0.0, 0.0, 0.0};
+    int previousclipped = 0;
+    for (int y=ystart; y<yend; y++){
+        uint8_t *row = &rows[ (size_t)(y - ystart) * stride];
+        const uint8_t *maskrow = (mask != NULL) ? &mask[ (size_t)(y - ystart) * maskstride] : NULL;
+        // padding around sprites is often whole rows of nothing, and so is most of a mask
+        if (skiptransparent && rowistransparent(&row[xstart * 4], span)) continue;
+        if ((maskrow != NULL) && rowisunmasked(&maskrow[xstart], span)) continue;
+        double rowterm = ditherrowterm(y);
+        double flippedrowterm = ditherrowterm(height - y - 1);
+        
+        int count = span;
+        bool compacted = false;
+        if (rowkernel){
+            // read out from buffer and convert to linear RGB float
+            if (skiptransparent || (maskrow != NULL)){
+                // just the pixels that are to be converted, packed together, remembering where each one came from
+                compacted = true;
+                count = 0;
+                for (int x=xstart; x<xend; x++){
+                    if (skiptransparent && (row[(x * 4) + 3] == 0)) continue;
+                    if ((maskrow != NULL) && (maskrow[x] == 0)) continue;
+                    ts->rowpositions[count] = x;
+                    red[count] = lineartable[row[(x * channels)]];
+                    green[count] = lineartable[row[(x * channels) + 1]];
+                    blue[count] = lineartable[row[(x * channels) + 2]];
+                    count++;
+                }
+            }
+            else {
+                for (int i=0; i<span; i++){
+                    const uint8_t *pixel = &row[(xstart + i) * channels];
+                    red[i] = lineartable[pixel[0]];
+                    green[i] = lineartable[pixel[1]];
+                    blue[i] = lineartable[pixel[2]];
+                }
+            }
+            // Multiply by one of the profile's gamut conversion Bradford matrices and clamp to 0-1
+            context->matrixrow(matrix, red, green, blue, count, &ts->clips);
+            // back to sRGB
+            encodegammarow(pipe, red, count);
+            encodegammarow(pipe, green, count);
+            encodegammarow(pipe, blue, count);
+        }
+        
+        for (int i=0; i<count; i++){
+            
+            int x = compacted ? positions[i] : (xstart + i);
+            // run the color through the gamut conversion, either directly or via the memo
+            uint8_t *pixel = &row[x * channels];
+            // don't touch alpha value
+            float newcolor[3];
+            if (rowkernel){
+                newcolor[0] = red[i];
+                newcolor[1] = green[i];
+                newcolor[2] = blue[i];
+            }
+            else {
+                if (skiptransparent && (pixel[3] == 0)) continue;
+                if ((maskrow != NULL) && (maskrow[x] == 0)) continue;
+                int key = (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+                if (key != previous){
+                    if (ts->usememo){
+                        previousclipped = memoconvertcolor(&ts->memo, pixel[0], pixel[1], pixel[2], pipe, mode, previouscolor);
+                    }
+                    else {
+                        previousclipped = convertcolor(pixel[0], pixel[1], pixel[2], pipe, mode, previouscolor);
+                    }
+                    previous = key;
+                }
+                newcolor[0] = previouscolor[0];
+                newcolor[1] = previouscolor[1];
+                newcolor[2] = previouscolor[2];
+                ts->clips.low += (previousclipped & CLIPPED_LOW) ? 1 : 0;
+                ts->clips.high += (previousclipped & CLIPPED_HIGH) ? 1 : 0;
+            }
+            
+            // convert back to 0-255 with quasirandom dithering, and save back to buffer
+            // use inverse x coord for red and inverse y coord for blue to decouple dither patterns across channels
+            // see https://blog.kaetemi.be/2015/04/01/practical-bayer-dithering/
+            if (dithertable){
+                pixel[0] = applydither(newcolor[0], tabledither(columns[width - x - 1], rowterm));
+                pixel[1] = applydither(newcolor[1], tabledither(columns[x], rowterm));
+                pixel[2] = applydither(newcolor[2], tabledither(columns[x], flippedrowterm));
+            }
+            else {
+                pixel[0] = quasirandomdither(newcolor[0], width - x - 1, y);
+                pixel[1] = quasirandomdither(newcolor[1], x, y);
+                pixel[2] = quasirandomdither(newcolor[2], x, height - y - 1);
+            }
+            
+        }
+    }
+}
+
+// true if every pixel in the 16-bit row has alpha 0
+static bool row16istransparent(const uint16_t* row, int width){
+    for (int x=0; x<width; x++){
+        if (row[(x * 4) + 3] != 0) return false;
+    }
+    return true;
+}
+
+// convertrows() for 16-bit RGBA, always through the float pipeline, dithering down to 16 bits instead of 8.
+// If linear is set the samples are already linear light, so there's no decoding to do at all.
+static void convertrows16(const ntscj_context* context, threadspace* ts, uint8_t* rows, size_t stride, const uint8_t* mask, size_t maskstride, int width, int height, int xstart, int xend, int ystart, int yend, int mode, bool linear){
+    bool skiptransparent = context->options.skiptransparent;
+    const pipeline* pipe = &context->pipeline;
+    const float (*matrix)[3] = pipe->profile->matrices[(mode == 1) ? 0 : 1];
+    const float* lineartable16 = pipe->decode->lineartable16;
+    // without a row buffer, go pixel by pixel
+    int span = xend - xstart;
+    bool rowkernel = reserverowbuffer(ts, span);
+    float* red = ts->rowbuffer;
+    float* green = red + span;
+    float* blue = green + span;
+    const int* positions = ts->rowpositions;
+    bool dithertable = reservedithertable(ts, width);
+    const double* columns = ts->dithertable;
+    for (int y=ystart; y<yend; y++){
+        uint16_t *row = (uint16_t*)&rows[ (size_t)(y - ystart) * stride];
+        const uint8_t *maskrow = (mask != NULL) ? &mask[ (size_t)(y - ystart) * maskstride] : NULL;
+        if (skiptransparent && row16istransparent(&row[xstart * 4], span)) continue;
+        if ((maskrow != NULL) && rowisunmasked(&maskrow[xstart], span)) continue;
+        double rowterm = ditherrowterm(y);
+        double flippedrowterm = ditherrowterm(height - y - 1);
+        
+        int count = span;
+        bool compacted = false;
+        if (rowkernel){
+            count = 0;
+            compacted = skiptransparent || (maskrow != NULL);
+            for (int x=xstart; x<xend; x++){
+                const uint16_t *pixel = &row[x * 4];
+                if (skiptransparent && (pixel[3] == 0)) continue;
+                if ((maskrow != NULL) && (maskrow[x] == 0)) continue;
+                ts->rowpositions[count] = x;
+                if (linear){
+                    red[count] = pixel[0] / 65535.0f;
+                    green[count] = pixel[1] / 65535.0f;
+                    blue[count] = pixel[2] / 65535.0f;
+                }
+                else {
+                    red[count] = lineartable16[pixel[0]];
+                    green[count] = lineartable16[pixel[1]];
+                    blue[count] = lineartable16[pixel[2]];
+                }
+                count++;
+            }
+            context->matrixrow(matrix, red, green, blue, count, &ts->clips);
+            encodegammarow(pipe, red, count);
+            encodegammarow(pipe, green, count);
+            encodegammarow(pipe, blue, count);
+        }
+        
+        for (int i=0; i<count; i++){
+            int x = compacted ? positions[i] : (xstart + i);
+            uint16_t *pixel = &row[x * 4];
+            float newcolor[3];
+            if (rowkernel){
+                newcolor[0] = red[i];
+                newcolor[1] = green[i];
+                newcolor[2] = blue[i];
+            }
+            else {
+                if (skiptransparent && (pixel[3] == 0)) continue;
+                if ((maskrow != NULL) && (maskrow[x] == 0)) continue;
+                int clipped = linear ? convertlinearcolor(pixel[0] / 65535.0f, pixel[1] / 65535.0f, pixel[2] / 65535.0f, pipe, mode, newcolor)
+                                     : convertlinearcolor(lineartable16[pixel[0]], lineartable16[pixel[1]], lineartable16[pixel[2]], pipe, mode, newcolor);
+                ts->clips.low += (clipped & CLIPPED_LOW) ? 1 : 0;
+                ts->clips.high += (clipped & CLIPPED_HIGH) ? 1 : 0;
+            }
+            // same dither positions as the 8-bit path, just a smaller step
+            if (dithertable){
+                pixel[0] = applydither16(newcolor[0], tabledither(columns[width - x - 1], rowterm));
+                pixel[1] = applydither16(newcolor[1], tabledither(columns[x], rowterm));
+                pixel[2] = applydither16(newcolor[2], tabledither(columns[x], flippedrowterm));
+            }
+            else {
+                pixel[0] = applydither16(newcolor[0], tabledither(dithercolumnterm(width - x - 1), rowterm));
+                pixel[1] = applydither16(newcolor[1], tabledither(dithercolumnterm(x), rowterm));
+                pixel[2] = applydither16(newcolor[2], tabledither(dithercolumnterm(x), flippedrowterm));
+            }
+        }
+    }
+}
+
+// Pixel layouts convertblock() takes: 8-bit RGBA or RGB, and 16-bit RGBA, sRGB encoded or linear.
+enum { FORMAT_RGBA8 = 0, FORMAT_RGB8 = 1, FORMAT_RGBA16 = 2, FORMAT_LINEAR_RGBA16 = 3 };
+
+// One horizontal band of the image for one thread to convert.
+typedef struct bandjob {
+    const ntscj_context* context;
+    threadspace* ts;
+    uint8_t* rows; // start of row ystart
+    size_t stride;
+    int width;
+    int height;
+    int ystart;
+    int yend;
+    int mode;
+    int format; // one of the FORMAT_ layouts
+} bandjob;
+
+// convertrows() or convertrows16()
+static void convertblock(const ntscj_context* context, threadspace* ts, uint8_t* rows, size_t stride, const uint8_t* mask, size_t maskstride,
+                         int width, int height, int xstart, int xend, int ystart, int yend, int mode, int format){
+    switch (format){
+        case FORMAT_RGBA16:
+        case FORMAT_LINEAR_RGBA16:
+            convertrows16(context, ts, rows, stride, mask, maskstride, width, height, xstart, xend, ystart, yend, mode, format == FORMAT_LINEAR_RGBA16);
+            break;
+        case FORMAT_RGB8:
+            convertrows(context, ts, rows, stride, mask, maskstride, width, height, xstart, xend, ystart, yend, 3, mode);
+            break;
+        default:
+            convertrows(context, ts, rows, stride, mask, maskstride, width, height, xstart, xend, ystart, yend, 4, mode);
+            break;
+    }
+}
+
+static void* bandthread(void* arg){
+    bandjob* job = arg;
+    convertblock(job->context, job->ts, job->rows, job->stride, NULL, 0, job->width, job->height, 0, job->width, job->ystart, job->yend, job->mode, job->format);
+    return NULL;
+}
+
+// Split the rows into bands across the context's threads.
+// Each pixel is independent and the dither only depends on (x,y), so the output doesn't depend on the thread count,
+// or on how the image is cut into strips.
+static void convertbands(ntscj_context* context, uint8_t* rows, size_t stride, int width, int height, int ystart, int rowcount, int mode, int format){
+    int bands = context->options.threads;
+    if (bands > rowcount) bands = rowcount;
+    if (bands < 1) bands = 1;
+    
+    bandjob jobs[bands];
+    pthread_t threads[bands];
+    bool started[bands];
+    for (int i=0; i<bands; i++){
+        int bandstart = (int)(((long long)rowcount * i) / bands);
+        jobs[i].context = context;
+        jobs[i].ts = &context->spaces[i];
+        jobs[i].rows = &rows[ (size_t)bandstart * stride];
+        jobs[i].stride = stride;
+        jobs[i].width = width;
+        jobs[i].height = height;
+        jobs[i].ystart = ystart + bandstart;
+        jobs[i].yend = ystart + (int)(((long long)rowcount * (i + 1)) / bands);
+        jobs[i].mode = mode;
+        jobs[i].format = format;
+    }
+    // this thread takes band 0 itself
+    for (int i=1; i<bands; i++){
+        started[i] = (pthread_create(&threads[i], NULL, bandthread, &jobs[i]) == 0);
+    }
+    bandthread(&jobs[0]);
+    for (int i=1; i<bands; i++){
+        if (started[i]){
+            pthread_join(threads[i], NULL);
+        }
+        else {
+            // couldn't get a thread, so do it here
+            bandthread(&jobs[i]);
+        }
+    }
+}
+
+void ntscj_convert_rows(ntscj_context* context, uint8_t* rows, size_t stride, int width, int height, int ystart, int rowcount, ntscj_direction direction){
+    int mode = (int)direction;
+#ifdef NTSCJ_WITH_OPENCL
+    if ((context->gpu != NULL) && (rowcount > 0) &&
+        gpuconvertrows(context->gpu, rows, stride, width, height, ystart, rowcount, mode, context->options.skiptransparent, &context->spaces[0].clips)){
+        return;
+    }
+#endif
+    convertbands(context, rows, stride, width, height, ystart, rowcount, mode, FORMAT_RGBA8);
+}
+
+void ntscj_convert_rows_rgb(ntscj_context* context, uint8_t* rows, size_t stride, int width, int height, int ystart, int rowcount, ntscj_direction direction){
+    convertbands(context, rows, stride, width, height, ystart, rowcount, (int)direction, FORMAT_RGB8);
+}
+
+void ntscj_convert_rows16(ntscj_context* context, uint16_t* rows, size_t stride, int width, int height, int ystart, int rowcount, ntscj_direction direction, bool linear){
+    preparetransfer(&transfers[validtransfer(context->options.decode)], false, false, true);
+    convertbands(context, (uint8_t*)rows, stride, width, height, ystart, rowcount, (int)direction, linear ? FORMAT_LINEAR_RGBA16 : FORMAT_RGBA16);
+}
+
+// Pieces of the image for the context's threads to take in turn, for ntscj_convert_rects().
+typedef struct rectqueue {
+    const ntscj_context* context;
+    uint8_t* rows; // start of row ystart
+    size_t stride;
+    const uint8_t* mask; // NULL, or the mask for row ystart
+    size_t maskstride;
+    int width;
+    int height;
+    int ystart;
+    int mode;
+    int format;
+    const ntscj_rect* pieces;
+    int count;
+    int next; // first piece nobody has taken yet
+    pthread_mutex_t lock;
+} rectqueue;
+
+typedef struct rectworker {
+    rectqueue* queue;
+    threadspace* ts;
+} rectworker;
+
+static void* rectthread(void* arg){
+    rectworker* worker = arg;
+    rectqueue* queue = worker->queue;
+    for (;;){
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (index >= queue->count) break;
+        const ntscj_rect* piece = &queue->pieces[index];
+        size_t row = (size_t)(piece->y - queue->ystart);
+        convertblock(queue->context, worker->ts, &queue->rows[row * queue->stride], queue->stride, (queue->mask != NULL) ? &queue->mask[row * queue->maskstride] : NULL, queue->maskstride,
+                     queue->width, queue->height, piece->x, piece->x + piece->width, piece->y, piece->y + piece->height, queue->mode, queue->format);
+    }
+    return NULL;
+}
+
+// Shrink rect to where it overlaps other. Returns false if they don't overlap at all.
+static bool intersectrect(ntscj_rect* rect, const ntscj_rect* other){
+    if ((rect->width <= 0) || (rect->height <= 0)) return false;
+    long long x0 = (rect->x > other->x) ? rect->x : other->x;
+    long long y0 = (rect->y > other->y) ? rect->y : other->y;
+    long long x1 = ((long long)rect->x + rect->width < (long long)other->x + other->width) ? ((long long)rect->x + rect->width) : ((long long)other->x + other->width);
+    long long y1 = ((long long)rect->y + rect->height < (long long)other->y + other->height) ? ((long long)rect->y + rect->height) : ((long long)other->y + other->height);
+    if ((x1 <= x0) || (y1 <= y0)) return false;
+    rect->x = (int)x0;
+    rect->y = (int)y0;
+    rect->width = (int)(x1 - x0);
+    rect->height = (int)(y1 - y0);
+    return true;
+}
+
+// Clip the rectangles to rows ystart through yend-1, and cut them into pieces on a grid of tilewidth x tileheight blocks
+// with a corner at (0,gridy). Returns the number of pieces written to pieces, or if pieces is NULL, how many there would be.
+static int cutrects(const ntscj_rect* rects, int count, int width, int height, int ystart, int yend, int tilewidth, int tileheight, int gridy, ntscj_rect* pieces){
+    ntscj_rect whole = {0, 0, width, height};
+    if (rects == NULL){
+        rects = &whole;
+        count = 1;
+    }
+    ntscj_rect strip = {0, ystart, width, yend - ystart};
+    int total = 0;
+    for (int i=0; i<count; i++){
+        ntscj_rect rect = rects[i];
+        if (!intersectrect(&rect, &strip)) continue;
+        for (int ty=gridy + ((rect.y - gridy) / tileheight) * tileheight; ty<rect.y + rect.height; ty+=tileheight){
+            for (int tx=(rect.x / tilewidth) * tilewidth; tx<rect.x + rect.width; tx+=tilewidth){
+                ntscj_rect piece = {tx, ty, tilewidth, tileheight};
+                if (!intersectrect(&piece, &rect)) continue;
+                if (pieces != NULL) pieces[total] = piece;
+                total++;
+            }
+        }
+    }
+    return total;
+}
+
+// The rectangles go to the CPU even with a gpu, which is no loss: the CPU runs the same fixed-point pipeline.
+static void convertrects(ntscj_context* context, uint8_t* rows, size_t stride, const uint8_t* mask, size_t maskstride, int width, int height, int ystart, int rowcount,
+                         const ntscj_rect* rects, int count, int tilesize, int mode, int format){
+    int yend = ystart + rowcount;
+    if (rowcount <= 0) return;
+    // without a tile size, cut the rows into a band per thread as usual
+    int tilewidth = (tilesize > 0) ? tilesize : width;
+    int tileheight = (tilesize > 0) ? tilesize : ((rowcount + context->options.threads - 1) / context->options.threads);
+    int gridy = (tilesize > 0) ? 0 : ystart;
+    int total = cutrects(rects, count, width, height, ystart, yend, tilewidth, tileheight, gridy, NULL);
+    if (total == 0) return;
+    ntscj_rect* pieces = malloc((size_t)total * sizeof(ntscj_rect));
+    if (pieces == NULL){
+        // no room for the list, so do the rectangles whole, one after another
+        ntscj_rect strip = {0, ystart, width, rowcount};
+        for (int i=0; i<((rects != NULL) ? count : 1); i++){
+            ntscj_rect rect = (rects != NULL) ? rects[i] : strip;
+            if (!intersectrect(&rect, &strip)) continue;
+            size_t row = (size_t)(rect.y - ystart);
+            convertblock(context, &context->spaces[0], &rows[row * stride], stride, (mask != NULL) ? &mask[row * maskstride] : NULL, maskstride, width, height,
+                         rect.x, rect.x + rect.width, rect.y, rect.y + rect.height, mode, format);
+        }
+        return;
+    }
+    cutrects(rects, count, width, height, ystart, yend, tilewidth, tileheight, gridy, pieces);
+    
+    rectqueue queue = {context, rows, stride, mask, maskstride, width, height, ystart, mode, format, pieces, total, 0, PTHREAD_MUTEX_INITIALIZER};
+    int workers = context->options.threads;
+    if (workers > total) workers = total;
+    rectworker jobs[workers];
+    pthread_t threads[workers];
+    bool started[workers];
+    for (int i=0; i<workers; i++){
+        jobs[i].queue = &queue;
+        jobs[i].ts = &context->spaces[i];
+    }
+    // this thread works too; if a thread can't be started, the others just take its share
+    for (int i=1; i<workers; i++){
+        started[i] = (pthread_create(&threads[i], NULL, rectthread, &jobs[i]) == 0);
+    }
+    rectthread(&jobs[0]);
+    for (int i=1; i<workers; i++){
+        if (started[i]){
+            pthread_join(threads[i], NULL);
+        }
+    }
+    pthread_mutex_destroy(&queue.lock);
+    free(pieces);
+}
+
+void ntscj_convert_rects(ntscj_context* context, uint8_t* rows, size_t stride, int width, int height, int ystart, int rowcount,
+                         const ntscj_rect* rects, int count, int tilesize, ntscj_direction direction){
+    convertrects(context, rows, stride, NULL, 0, width, height, ystart, rowcount, rects, count, tilesize, (int)direction, FORMAT_RGBA8);
+}
+
+void ntscj_convert_rects_rgb(ntscj_context* context, uint8_t* rows, size_t stride, int width, int height, int ystart, int rowcount,
+                             const ntscj_rect* rects, int count, int tilesize, ntscj_direction direction){
+    convertrects(context, rows, stride, NULL, 0, width, height, ystart, rowcount, rects, count, tilesize, (int)direction, FORMAT_RGB8);
+}
+
+void ntscj_convert_rects16(ntscj_context* context, uint16_t* rows, size_t stride, int width, int height, int ystart, int rowcount,
+                           const ntscj_rect* rects, int count, int tilesize, ntscj_direction direction, bool linear){
+    preparetransfer(&transfers[validtransfer(context->options.decode)], false, false, true);
+    convertrects(context, (uint8_t*)rows, stride, NULL, 0, width, height, ystart, rowcount, rects, count, tilesize, (int)direction, linear ? FORMAT_LINEAR_RGBA16 : FORMAT_RGBA16);
+}
+
+void ntscj_convert_masked(ntscj_context* context, uint8_t* rows, size_t stride, const uint8_t* mask, size_t maskstride, int width, int height, int ystart, int rowcount,
+                          const ntscj_rect* rects, int count, int tilesize, ntscj_direction direction){
+    convertrects(context, rows, stride, mask, maskstride, width, height, ystart, rowcount, rects, count, tilesize, (int)direction, FORMAT_RGBA8);
+}
+
+void ntscj_convert_masked_rgb(ntscj_context* context, uint8_t* rows, size_t stride, const uint8_t* mask, size_t maskstride, int width, int height, int ystart, int rowcount,
+                              const ntscj_rect* rects, int count, int tilesize, ntscj_direction direction){
+    convertrects(context, rows, stride, mask, maskstride, width, height, ystart, rowcount, rects, count, tilesize, (int)direction, FORMAT_RGB8);
+}
+
+void ntscj_convert_masked16(ntscj_context* context, uint16_t* rows, size_t stride, const uint8_t* mask, size_t maskstride, int width, int height, int ystart, int rowcount,
+                            const ntscj_rect* rects, int count, int tilesize, ntscj_direction direction, bool linear){
+    preparetransfer(&transfers[validtransfer(context->options.decode)], false, false, true);
+    convertrects(context, (uint8_t*)rows, stride, mask, maskstride, width, height, ystart, rowcount, rects, count, tilesize, (int)direction, linear ? FORMAT_LINEAR_RGBA16 : FORMAT_RGBA16);
+}
+
+bool ntscj_convert_rgba8(uint8_t* buffer, int width, int height, size_t stride, ntscj_direction direction, const ntscj_options* options){
+    ntscj_context* context = ntscj_create_context(options);
+    if (context == NULL) return false;
+    if (stride == 0) stride = (size_t)width * 4;
+    ntscj_convert_rows(context, buffer, stride, width, height, 0, height, direction);
+    ntscj_free_context(context);
+    return true;
+}
+
+// A palette entry has no position in the image, so there's nothing to dither against; round to nearest instead.
+// (Which is what the dither does with an offset of exactly 0.5.)
+void ntscj_convert_palette(ntscj_context* context, uint8_t* entries, int count, size_t entrysize, ntscj_direction direction){
+    int mode = (int)direction;
+    const ntscj_profile* profile = context->options.profile;
+    const int32_t (*fixedmatrix)[3] = profile->fixedmatrices[(mode == 1) ? 0 : 1];
+    ntscj_clipcount* clips = &context->spaces[0].clips;
+    for (int i=0; i<count; i++){
+        uint8_t* entry = &entries[(size_t)i * entrysize];
+        if (context->options.skiptransparent && (entrysize > 3) && (entry[3] == 0)) continue;
+        int clipped = 0;
+        if (context->options.lut != NULL){
+            float newcolor[3];
+            lutlookup(context->options.lut->values, context->lutaxes, context->options.trilinear, entry[0], entry[1], entry[2], newcolor);
+            for (int c=0; c<3; c++){
+                entry[c] = applydither(newcolor[c], 0.5);
+            }
+        }
+        else if (context->options.fixed){
+            int32_t red = fixedlineartable[entry[0]];
+            int32_t green = fixedlineartable[entry[1]];
+            int32_t blue = fixedlineartable[entry[2]];
+            uint16_t newcolor[3];
+            for (int c=0; c<3; c++){
+                newcolor[c] = fixedgammatable[fixedmatrixrow(fixedmatrix[c], red, green, blue, &clipped)];
+            }
+            for (int c=0; c<3; c++){
+                uint32_t output = (((uint32_t)newcolor[c] << 8) + 32768) >> 16;
+                entry[c] = (uint8_t)((output > 255) ? 255 : output);
+            }
+        }
+        else {
+            float newcolor[3];
+            clipped = convertcolor(entry[0], entry[1], entry[2], &context->pipeline, mode, newcolor);
+            for (int c=0; c<3; c++){
+                entry[c] = applydither(newcolor[c], 0.5);
+            }
+        }
+        clips->low += (clipped & CLIPPED_LOW) ? 1 : 0;
+        clips->high += (clipped & CLIPPED_HIGH) ? 1 : 0;
+    }
+}
+
+ntscj_clipcount ntscj_get_clip_counts(const ntscj_context* context){
+    ntscj_clipcount total = {0, 0};
+    for (int i=0; i<context->options.threads; i++){
+        total.low += context->spaces[i].clips.low;
+        total.high += context->spaces[i].clips.high;
+    }
+    return total;
+}
+
+void ntscj_reset_clip_counts(ntscj_context* context){
+    for (int i=0; i<context->options.threads; i++){
+        context->spaces[i].clips.low = 0;
+        context->spaces[i].clips.high = 0;
+    }
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+// Self test
+// Checks the fast paths against the straightforward reference code they replaced.
+
+// The dither table against quasirandomdither(), over every position in a 4096x4096 image and along the edges of far bigger ones.
+// Compares the dither offsets themselves rather than the dithered output, so a mismatch can't hide behind rounding.
+static long long selftestdither(FILE* report){
+    long long checked = 0;
+    long long mismatches = 0;
+    static const int bases[] = {0, 65536 - 2048, (1 << 24) - 2048, 2147483647 - 4096};
+    for (int b=0; b<4; b++){
+        for (int y=bases[b]; y<bases[b] + 4096; y++){
+            double rowterm = ditherrowterm(y);
+            // the big bases only get 16 rows, at the same huge x offset
+            if ((b > 0) && (y >= bases[b] + 16)) break;
+            for (int x=0; x<4096; x++){
+                int column = (b > 0) ? (bases[b] + x) : x;
+                double dummy;
+                float expected = folddither(modf(((float)(column + 1) * 0.7548776662) + ((float)(y + 1) * 0.56984029), &dummy));
+                float actual = tabledither(dithercolumnterm(column), rowterm);
+                checked++;
+                if (memcmp(&expected, &actual, sizeof(float)) != 0){
+                    if ((report != NULL) && (mismatches < 5)){
+                        fprintf(report, "dither mismatch at (%i,%i): expected %.9g, got %.9g\n", column, y, expected, actual);
+                    }
+                    mismatches++;
+                }
+            }
+        }
+    }
+    if (report != NULL){
+        fprintf(report, "dither table: %lld positions checked, %lld mismatches\n", checked, mismatches);
+    }
+    return mismatches;
+}
+
+// A whole image through ntscj_convert_rows() against convertcolor() and quasirandomdither() pixel by pixel.
+// Every 8-bit value turns up in every channel, in different combinations, with the alpha varying too.
+// Some rows are runs of repeated pixels and some are fully transparent, for the shortcuts those take.
+static void makeselftestimage(uint8_t* image, int width, int height){
+    size_t size = (size_t)width * height * 4;
+    uint32_t state = 12345;
+    for (size_t i=0; i<size; i++){
+        state = (state * 1103515245u) + 12345u;
+        image[i] = (uint8_t)(state >> 16);
+    }
+    for (int y=0; y<height; y++){
+        for (int x=0; x<width; x++){
+            uint8_t* pixel = &image[((size_t)y * width + x) * 4];
+            if ((y % 5 == 0) && (x % 8 != 0)) memcpy(pixel, pixel - 4, 3);
+            if (y % 7 == 0) pixel[3] = 0;
+        }
+    }
+}
+
+static long long selftestimage(FILE* report, int mode, const ntscj_options* options, const char* label){
+    const int width = 509; // odd sizes, so the kernels' tail loops get exercised too
+    const int height = 257;
+    size_t size = (size_t)width * height * 4;
+    uint8_t* image = malloc(size);
+    uint8_t* expected = malloc(size);
+    ntscj_context* context = ntscj_create_context(options);
+    if ((image == NULL) || (expected == NULL) || (context == NULL)){
+        if (report != NULL) fprintf(report, "out of memory for image self test\n");
+        free(image);
+        free(expected);
+        ntscj_free_context(context);
+        return 1;
+    }
+    makeselftestimage(image, width, height);
+    pipeline pipe;
+    makepipeline(options, &pipe);
+    for (int y=0; y<height; y++){
+        for (int x=0; x<width; x++){
+            uint8_t* pixel = &image[((size_t)y * width + x) * 4];
+            uint8_t* out = &expected[((size_t)y * width + x) * 4];
+            if (options->skiptransparent && (pixel[3] == 0)){
+                memcpy(out, pixel, 4);
+                continue;
+            }
+            float newcolor[3];
+            convertcolor(pixel[0], pixel[1], pixel[2], &pipe, mode, newcolor);
+            out[0] = quasirandomdither(newcolor[0], width - x - 1, y);
+            out[1] = quasirandomdither(newcolor[1], x, y);
+            out[2] = quasirandomdither(newcolor[2], x, height - y - 1);
+            out[3] = pixel[3];
+        }
+    }
+    ntscj_convert_rows(context, image, (size_t)width * 4, width, height, 0, height, (ntscj_direction)mode);
+    long long mismatches = 0;
+    for (size_t i=0; i<size; i++){
+        if (image[i] != expected[i]) mismatches++;
+    }
+    if (report != NULL){
+        fprintf(report, "%s image, %s kernel%s: %i pixels checked, %lld mismatches\n", (mode == 1) ? "ntscj-to-srgb" : "srgb-to-ntscj", ntscj_kernel_name(options), label, width * height, mismatches);
+    }
+    free(image);
+    free(expected);
+    ntscj_free_context(context);
+    return mismatches;
+}
+
+// Convert the same colors back and forth on one memo context, so a memo that ignored the direction would hand back the other direction's results.
+static long long selftestmemodirections(FILE* report){
+    const int width = 509;
+    const int height = 257;
+    size_t size = (size_t)width * height * 4;
+    uint8_t* source = malloc(size);
+    uint8_t* image = malloc(size);
+    uint8_t* expected = malloc(size);
+    ntscj_options options;
+    ntscj_default_options(&options);
+    ntscj_context* plain = ntscj_create_context(&options);
+    options.memo = true;
+    ntscj_context* memo = ntscj_create_context(&options);
+    if ((source == NULL) || (image == NULL) || (expected == NULL) || (plain == NULL) || (memo == NULL)){
+        if (report != NULL) fprintf(report, "out of memory for memo direction self test\n");
+        free(source);
+        free(image);
+        free(expected);
+        ntscj_free_context(plain);
+        ntscj_free_context(memo);
+        return 1;
+    }
+    makeselftestimage(source, width, height);
+    static const int modes[3] = {1, 2, 1};
+    long long mismatches = 0;
+    for (int i=0; i<3; i++){
+        memcpy(image, source, size);
+        memcpy(expected, source, size);
+        ntscj_convert_rows(memo, image, (size_t)width * 4, width, height, 0, height, (ntscj_direction)modes[i]);
+        ntscj_convert_rows(plain, expected, (size_t)width * 4, width, height, 0, height, (ntscj_direction)modes[i]);
+        for (size_t j=0; j<size; j++){
+            if (image[j] != expected[j]) mismatches++;
+        }
+    }
+    if (report != NULL){
+        fprintf(report, "memo image, both directions on one context: %i pixels checked, %lld mismatches\n", width * height * 3, mismatches);
+    }
+    free(source);
+    free(image);
+    free(expected);
+    ntscj_free_context(plain);
+    ntscj_free_context(memo);
+    return mismatches;
+}
+
+// Converting in tiles, or just some rectangles a strip at a time, or just the masked pixels, has to give exactly what converting
+// the whole image does inside the rectangles (and the mask), and leave everything else alone.
+static long long selftestrects(FILE* report, const ntscj_options* options, const char* label){
+    const int width = 509;
+    const int height = 257;
+    size_t size = (size_t)width * height * 4;
+    uint8_t* original = malloc(size);
+    uint8_t* whole = malloc(size);
+    uint8_t* image = malloc(size);
+    uint8_t* mask = malloc((size_t)width * height);
+    ntscj_options threaded = *options;
+    threaded.threads = 3;
+    ntscj_context* context = ntscj_create_context(&threaded);
+    if ((original == NULL) || (whole == NULL) || (image == NULL) || (mask == NULL) || (context == NULL)){
+        if (report != NULL) fprintf(report, "out of memory for tile self test\n");
+        free(original);
+        free(whole);
+        free(image);
+        free(mask);
+        ntscj_free_context(context);
+        return 1;
+    }
+    makeselftestimage(original, width, height);
+    memcpy(whole, original, size);
+    ntscj_convert_rows(context, whole, (size_t)width * 4, width, height, 0, height, NTSCJ_NTSCJ_TO_SRGB);
+    
+    memcpy(image, original, size);
+    ntscj_convert_rects(context, image, (size_t)width * 4, width, height, 0, height, NULL, 0, 64, NTSCJ_NTSCJ_TO_SRGB);
+    long long mismatches = 0;
+    for (size_t i=0; i<size; i++){
+        if (image[i] != whole[i]) mismatches++;
+    }
+    
+    // some hanging off the edges, one empty, cut into 16x16 tiles, converted in two strips
+    const ntscj_rect rects[4] = {{10, 20, 100, 50}, {300, -5, 300, 40}, {-10, 200, 30, 100}, {50, 50, 0, 10}};
+    memcpy(image, original, size);
+    ntscj_convert_rects(context, image, (size_t)width * 4, width, height, 0, 100, rects, 4, 16, NTSCJ_NTSCJ_TO_SRGB);
+    ntscj_convert_rects(context, &image[(size_t)100 * width * 4], (size_t)width * 4, width, height, 100, height - 100, rects, 4, 16, NTSCJ_NTSCJ_TO_SRGB);
+    for (int y=0; y<height; y++){
+        for (int x=0; x<width; x++){
+            bool inside = false;
+            for (int i=0; i<4; i++){
+                inside |= (x >= rects[i].x) && (x < rects[i].x + rects[i].width) && (y >= rects[i].y) && (y < rects[i].y + rects[i].height);
+            }
+            size_t offset = ((size_t)y * width + x) * 4;
+            if (memcmp(&image[offset], inside ? &whole[offset] : &original[offset], 4) != 0) mismatches++;
+        }
+    }
+    
+    // a mask with whole empty rows and scattered pixels, together with the same rectangles
+    for (int y=0; y<height; y++){
+        for (int x=0; x<width; x++){
+            mask[(size_t)y * width + x] = ((y % 4 != 1) && ((x * y) % 3 == 0)) ? 255 : 0;
+        }
+    }
+    memcpy(image, original, size);
+    ntscj_convert_masked(context, image, (size_t)width * 4, mask, width, width, height, 0, height, rects, 4, 0, NTSCJ_NTSCJ_TO_SRGB);
+    for (int y=0; y<height; y++){
+        for (int x=0; x<width; x++){
+            bool inside = false;
+            for (int i=0; i<4; i++){
+                inside |= (x >= rects[i].x) && (x < rects[i].x + rects[i].width) && (y >= rects[i].y) && (y < rects[i].y + rects[i].height);
+            }
+            inside &= (mask[(size_t)y * width + x] != 0);
+            size_t offset = ((size_t)y * width + x) * 4;
+            if (memcmp(&image[offset], inside ? &whole[offset] : &original[offset], 4) != 0) mismatches++;
+        }
+    }
+    if (report != NULL){
+        fprintf(report, "tiles, rectangles, and masks, %s kernel%s: %i pixels checked three times, %lld mismatches\n", ntscj_kernel_name(options), label, width * height, mismatches);
+    }
+    free(original);
+    free(whole);
+    free(image);
+    free(mask);
+    ntscj_free_context(context);
+    return mismatches;
+}
+
+// RGB rows have to come out the same as the color channels of the same pixels in RGBA rows, converted whole, in tiles, or masked.
+static long long selftestrgb(FILE* report, const ntscj_options* options, const char* label){
+    const int width = 509;
+    const int height = 257;
+    size_t pixels = (size_t)width * height;
+    uint8_t* rgba = malloc(pixels * 4);
+    uint8_t* rgb = malloc(pixels * 3);
+    uint8_t* image = malloc(pixels * 3);
+    uint8_t* mask = malloc(pixels);
+    ntscj_options threaded = *options;
+    threaded.threads = 3;
+    ntscj_context* context = ntscj_create_context(&threaded);
+    if ((rgba == NULL) || (rgb == NULL) || (image == NULL) || (mask == NULL) || (context == NULL)){
+        if (report != NULL) fprintf(report, "out of memory for rgb self test\n");
+        free(rgba);
+        free(rgb);
+        free(image);
+        free(mask);
+        ntscj_free_context(context);
+        return 1;
+    }
+    makeselftestimage(rgba, width, height);
+    for (size_t i=0; i<pixels; i++){
+        rgba[(i * 4) + 3] = 255;
+        memcpy(&rgb[i * 3], &rgba[i * 4], 3);
+    }
+    for (size_t i=0; i<pixels; i++){
+        mask[i] = ((i % 7) < 4) ? 255 : 0;
+    }
+    long long mismatches = 0;
+    for (int pass=0; pass<3; pass++){
+        uint8_t* whole = malloc(pixels * 4);
+        if (whole == NULL){
+            mismatches++;
+            break;
+        }
+        memcpy(whole, rgba, pixels * 4);
+        memcpy(image, rgb, pixels * 3);
+        if (pass == 0){
+            ntscj_convert_rows(context, whole, (size_t)width * 4, width, height, 0, height, NTSCJ_NTSCJ_TO_SRGB);
+            ntscj_convert_rows_rgb(context, image, (size_t)width * 3, width, height, 0, height, NTSCJ_NTSCJ_TO_SRGB);
+        }
+        else if (pass == 1){
+            ntscj_convert_rects(context, whole, (size_t)width * 4, width, height, 0, height, NULL, 0, 64, NTSCJ_NTSCJ_TO_SRGB);
+            ntscj_convert_rects_rgb(context, image, (size_t)width * 3, width, height, 0, height, NULL, 0, 64, NTSCJ_NTSCJ_TO_SRGB);
+        }
+        else {
+            ntscj_convert_masked(context, whole, (size_t)width * 4, mask, width, width, height, 0, height, NULL, 0, 0, NTSCJ_NTSCJ_TO_SRGB);
+            ntscj_convert_masked_rgb(context, image, (size_t)width * 3, mask, width, width, height, 0, height, NULL, 0, 0, NTSCJ_NTSCJ_TO_SRGB);
+        }
+        for (size_t i=0; i<pixels; i++){
+            if (memcmp(&image[i * 3], &whole[i * 4], 3) != 0) mismatches++;
+        }
+        free(whole);
+    }
+    if (report != NULL){
+        fprintf(report, "rgb rows, tiles, and masks, %s kernel%s: %i pixels checked three times, %lld mismatches\n", ntscj_kernel_name(options), label, width * height, mismatches);
+    }
+    free(rgba);
+    free(rgb);
+    free(image);
+    free(mask);
+    ntscj_free_context(context);
+    return mismatches;
+}
+
+// quasirandomdither() down to 16 bits, for checking convertrows16()
+static uint16_t quasirandomdither16(float input, int x, int y){
+    x++;
+    y++;
+    double dummy;
+    float dither = modf(((float)x * 0.7548776662) + ((float)y * 0.56984029), &dummy);
+    return applydither16(input, folddither(dither));
+}
+
+// Convert a 16-bit image through ntscj_convert_rows16() and check it against convertlinearcolor() and quasirandomdither16().
+static long long selftestimage16(FILE* report, int mode, bool linear){
+    const int width = 509;
+    const int height = 129;
+    size_t count = (size_t)width * height * 4;
+    uint16_t* image = malloc(count * sizeof(uint16_t));
+    uint16_t* original = malloc(count * sizeof(uint16_t));
+    ntscj_context* context = ntscj_create_context(NULL);
+    if ((image == NULL) || (original == NULL) || (context == NULL)){
+        if (report != NULL) fprintf(report, "out of memory for 16-bit self test\n");
+        free(image);
+        free(original);
+        ntscj_free_context(context);
+        return 1;
+    }
+    uint32_t state = 54321;
+    for (size_t i=0; i<count; i++){
+        state = (state * 1103515245u) + 12345u;
+        image[i] = (uint16_t)(state >> 16);
+    }
+    memcpy(original, image, count * sizeof(uint16_t));
+    ntscj_convert_rows16(context, image, (size_t)width * 8, width, height, 0, height, (ntscj_direction)mode, linear);
+    long long mismatches = 0;
+    for (int y=0; y<height; y++){
+        for (int x=0; x<width; x++){
+            const uint16_t* pixel = &original[((size_t)y * width + x) * 4];
+            const uint16_t* out = &image[((size_t)y * width + x) * 4];
+            float input[3];
+            for (int c=0; c<3; c++){
+                input[c] = linear ? (pixel[c] / 65535.0f) : tolinear(pixel[c] / 65535.0);
+            }
+            float newcolor[3];
+            convertlinearcolor(input[0], input[1], input[2], &defaultpipeline, mode, newcolor);
+            if ((out[0] != quasirandomdither16(newcolor[0], width - x - 1, y)) ||
+                (out[1] != quasirandomdither16(newcolor[1], x, y)) ||
+                (out[2] != quasirandomdither16(newcolor[2], x, height - y - 1)) ||
+                (out[3] != pixel[3])){
+                mismatches++;
+            }
+        }
+    }
+    if (report != NULL){
+        fprintf(report, "%s 16-bit %s image: %i pixels checked, %lld mismatches\n", (mode == 1) ? "ntscj-to-srgb" : "srgb-to-ntscj", linear ? "linear" : "sRGB", width * height, mismatches);
+    }
+    free(image);
+    free(original);
+    ntscj_free_context(context);
+    return mismatches;
+}
+
+// Each encode table has to stay within 1e-6 of its transfer function (about 1/4000 of an 8-bit step), from 2^-32 up to 1,
+// both in even steps and in even ratios, since the power curve tables are spaced the second way.
+static long long selftesttransfers(FILE* report){
+    long long mismatches = 0;
+    const int samples = 1 << 20;
+    for (int t=0; t<TRANSFERS; t++){
+        transfer* curve = &transfers[t];
+        preparetransfer(curve, false, true, false);
+        double worst = 0.0;
+        for (int i=0; i<=samples; i++){
+            float inputs[2] = {(float)i / samples, (float)pow(2.0, -32.0 * i / samples)};
+            for (int j=0; j<2; j++){
+                float fast = curve->power ? fastpowertogamma(curve->gammatable, inputs[j]) : fasttogamma(curve->gammatable, inputs[j]);
+                double error = fabs((double)fast - curve->togamma(inputs[j]));
+                if (error > worst) worst = error;
+            }
+        }
+        if (worst > 1e-6) mismatches++;
+        if (report != NULL){
+            fprintf(report, "%s encode table: %i values checked, worst error %.2g\n", curve->name, (samples + 1) * 2, worst);
+        }
+    }
+    return mismatches;
+}
+
+// The profile math has to reproduce the constant ntscj matrices from their gamut, every profile has to map its white to sRGB white
+// and have matrices that undo each other, and ntscj_add_profile() has to refuse names already taken by other gamuts and degenerate gamuts.
+static long long selftestprofiles(FILE* report){
+    long long mismatches = 0;
+    ntscj_profile computed = {.name = "ntscj", .gamut = DEFAULT_PROFILE->gamut};
+    if (!computeprofile(&computed)) mismatches++;
+    for (int m=0; m<2; m++){
+        for (int i=0; i<3; i++){
+            for (int j=0; j<3; j++){
+                if (fabsf(computed.matrices[m][i][j] - DEFAULT_PROFILE->matrices[m][i][j]) > 1e-6f) mismatches++;
+            }
+        }
+    }
+    for (int p=0; p<BUILTIN_PROFILES; p++){
+        const ntscj_profile* profile = &builtinprofiles[p];
+        for (int i=0; i<3; i++){
+            const float* row = profile->matrices[0][i];
+            if (fabsf(row[0] + row[1] + row[2] - 1.0f) > 1e-5f) mismatches++;
+            for (int j=0; j<3; j++){
+                float product = 0.0f;
+                for (int k=0; k<3; k++){
+                    product += profile->matrices[1][i][k] * profile->matrices[0][k][j];
+                }
+                if (fabsf(product - ((i == j) ? 1.0f : 0.0f)) > 1e-5f) mismatches++;
+            }
+        }
+    }
+    ntscj_gamut gamut = DEFAULT_PROFILE->gamut;
+    if (ntscj_add_profile("ntscj", &gamut) != DEFAULT_PROFILE) mismatches++;
+    gamut.white[0] = 0.3;
+    if (ntscj_add_profile("ntscj", &gamut) != NULL) mismatches++;
+    gamut.green[0] = gamut.red[0];
+    gamut.green[1] = gamut.red[1];
+    if ((ntscj_add_profile("self test degenerate gamut", &gamut) != NULL) || (ntscj_find_profile("self test degenerate gamut") != NULL)) mismatches++;
+    if (report != NULL){
+        fprintf(report, "gamut profiles: %i built in, %lld mismatches\n", BUILTIN_PROFILES, mismatches);
+    }
+    return mismatches;
+}
+
+// On its grid points, a LUT made from the pipeline has to give exactly what the pipeline does, however it interpolates.
+// A 52 point grid has a point at every multiple of 5, so this converts an image of those through the LUT and through convertcolor().
+static long long selftestlut(FILE* report, int mode, bool trilinear){
+    const int width = 52 * 52;
+    const int height = 52;
+    size_t size = (size_t)width * height * 4;
+    uint8_t* image = malloc(size);
+    ntscj_lut* lut = ntscj_make_lut(52, (ntscj_direction)mode, NULL);
+    ntscj_options options;
+    ntscj_default_options(&options);
+    options.lut = lut;
+    options.trilinear = trilinear;
+    ntscj_context* context = (lut != NULL) ? ntscj_create_context(&options) : NULL;
+    if ((image == NULL) || (context == NULL)){
+        if (report != NULL) fprintf(report, "out of memory for lut self test\n");
+        free(image);
+        ntscj_free_lut(lut);
+        ntscj_free_context(context);
+        return 1;
+    }
+    for (int y=0; y<height; y++){
+        for (int x=0; x<width; x++){
+            uint8_t* pixel = &image[((size_t)y * width + x) * 4];
+            pixel[0] = (uint8_t)((x % 52) * 5);
+            pixel[1] = (uint8_t)((x / 52) * 5);
+            pixel[2] = (uint8_t)(y * 5);
+            pixel[3] = 255;
+        }
+    }
+    ntscj_convert_rows(context, image, (size_t)width * 4, width, height, 0, height, (ntscj_direction)mode);
+    long long mismatches = 0;
+    for (int y=0; y<height; y++){
+        for (int x=0; x<width; x++){
+            uint8_t* pixel = &image[((size_t)y * width + x) * 4];
+            float newcolor[3];
+            convertcolor((uint8_t)((x % 52) * 5), (uint8_t)((x / 52) * 5), (uint8_t)(y * 5), &defaultpipeline, mode, newcolor);
+            if ((pixel[0] != quasirandomdither(newcolor[0], width - x - 1, y)) ||
+                (pixel[1] != quasirandomdither(newcolor[1], x, y)) ||
+                (pixel[2] != quasirandomdither(newcolor[2], x, height - y - 1))){
+                mismatches++;
+            }
+        }
+    }
+    if (report != NULL){
+        fprintf(report, "%s %s on its grid: %i pixels checked, %lld mismatches\n", (mode == 1) ? "ntscj-to-srgb" : "srgb-to-ntscj", ntscj_kernel_name(&options), width * height, mismatches);
+    }
+    free(image);
+    ntscj_free_lut(lut);
+    ntscj_free_context(context);
+    return mismatches;
+}
+
+// The exhaustive test: every 24-bit color through every kernel, against the conversion done the original way.
+
+// One way of converting for ntscj_self_test_exhaustive(), and how far from the reference it's allowed to be.
+typedef struct exhaustivekernel {
+    const char* label;
+    ntscj_options options;
+    bool rgb; // convert through ntscj_convert_rows_rgb() instead
+    bool bounded; // held to allowed and allowedrate; otherwise just reported
+    int allowed; // largest difference allowed in any channel
+    double allowedrate; // largest fraction of channels allowed to differ at all
+    bool tabled; // must give exactly what the first kernel does, like every other float kernel with the interpolated table
+    ntscj_context* context;
+    long long mismatches; // channels that differ from the reference
+    int deviation; // largest difference from the reference in any channel
+    long long divergences; // pixels that differ from the first kernel, for the tabled ones
+} exhaustivekernel;
+
+// The per-pixel loop the fast paths replaced: the transfer functions themselves, the matrix, the clamp, and quasirandomdither().
+static void referenceconvertpixel(const pipeline* pipe, int mode, const uint8_t* pixel, uint8_t* output, int x, int y, int width, int height){
+    float red = pipe->decode->tolinear(pixel[0] / 255.0);
+    float green = pipe->decode->tolinear(pixel[1] / 255.0);
+    float blue = pipe->decode->tolinear(pixel[2] / 255.0);
+    const float (*matrix)[3] = pipe->profile->matrices[(mode == 1) ? 0 : 1];
+    float newred = matrix[0][0] * red + matrix[0][1] * green + matrix[0][2] * blue;
+    float newgreen = matrix[1][0] * red + matrix[1][1] * green + matrix[1][2] * blue;
+    float newblue = matrix[2][0] * red + matrix[2][1] * green + matrix[2][2] * blue;
+    output[0] = quasirandomdither(pipe->encode->togamma(clampfloat(newred)), width - x - 1, y);
+    output[1] = quasirandomdither(pipe->encode->togamma(clampfloat(newgreen)), x, y);
+    output[2] = quasirandomdither(pipe->encode->togamma(clampfloat(newblue)), x, height - y - 1);
+}
+
+// rows per strip of the 4096x4096 image of every color
+#define EXHAUSTIVE_ROWS 64
+#define EXHAUSTIVE_KERNELS 9
+
+long long ntscj_self_test_exhaustive(FILE* report, const ntscj_options* options, int passes){
+    ntscj_init();
+    ntscj_options base;
+    ntscj_default_options(&base);
+    if (options != NULL){
+        base.profile = options->profile;
+        base.decode = validtransfer(options->decode);
+        base.encode = validtransfer(options->encode);
+    }
+    if (passes < 1) passes = 1;
+    pipeline pipe;
+    makepipeline(&base, &pipe);
+    const int width = 4096;
+    const int height = 4096 * passes;
+    size_t strippixels = (size_t)width * EXHAUSTIVE_ROWS;
+    uint8_t* input = malloc(strippixels * 4);
+    uint8_t* reference = malloc(strippixels * 3);
+    uint8_t* first = malloc(strippixels * 4);
+    uint8_t* image = malloc(strippixels * 4);
+    if ((input == NULL) || (reference == NULL) || (first == NULL) || (image == NULL)){
+        if (report != NULL) fprintf(report, "out of memory for exhaustive self test\n");
+        free(input);
+        free(reference);
+        free(first);
+        free(image);
+        return 1;
+    }
+    
+    long long failures = 0;
+    for (int mode=1; mode<=2; mode++){
+        // the tabled float kernels first, then the ones allowed to round differently
+        exhaustivekernel kernels[EXHAUSTIVE_KERNELS];
+        int count = 0;
+        ntscj_lut* lut = ntscj_make_lut(65, (ntscj_direction)mode, &base);
+        for (int i=0; i<EXHAUSTIVE_KERNELS; i++){
+            exhaustivekernel* kernel = &kernels[count];
+            memset(kernel, 0, sizeof *kernel);
+            kernel->options = base;
+            kernel->bounded = true;
+            kernel->allowed = 1;
+            kernel->allowedrate = 0.0001;
+            kernel->tabled = true;
+            switch (i){
+                case 0: kernel->label = "scalar"; kernel->options.simd = false; break;
+                case 1: kernel->label = ntscj_kernel_name(&base); if (strcmp(kernel->label, "scalar") == 0) continue; break;
+                case 2: kernel->label = "3 threads"; kernel->options.threads = 3; break;
+                case 3: kernel->label = "memo"; kernel->options.memo = true; break;
+                case 4: kernel->label = "rgb"; kernel->rgb = true; break;
+                case 5: kernel->label = "exact"; kernel->options.exact = true; kernel->allowed = 0; kernel->allowedrate = 0.0; kernel->tabled = false; break;
+                case 6: kernel->label = "fixed"; kernel->options.fixed = true; kernel->allowedrate = 0.01; kernel->tabled = false; if (!srgbtransfers(&base)) continue; break;
+                case 7: kernel->label = "gpu"; kernel->options.gpu = true; kernel->allowedrate = 0.01; kernel->tabled = false; if (!srgbtransfers(&base)) continue; break;
+                // how far a LUT is off between its grid points depends on the curves; selftestlut() checks the grid points themselves
+                case 8: kernel->label = "65-point lut"; kernel->options.lut = lut; kernel->bounded = false; kernel->tabled = false; if (lut == NULL) continue; break;
+            }
+            kernel->context = ntscj_create_context(&kernel->options);
+            if (kernel->context == NULL){
+                if (report != NULL) fprintf(report, "out of memory for the %s kernel\n", kernel->label);
+                failures++;
+                continue;
+            }
+            // without a device it would only be the fixed kernel again
+            if (kernel->options.gpu && !ntscj_context_uses_gpu(kernel->context)){
+                ntscj_free_context(kernel->context);
+                continue;
+            }
+            count++;
+        }
+        
+        // each pass is another 4096 rows further down, with the colors in a different order,
+        // so every color gets dithered at passes different positions
+        for (int pass=0; pass<passes; pass++){
+            uint32_t multiplier = (pass == 0) ? 1 : (0x9e3779b1u + (2 * pass));
+            for (int ystart=pass * 4096; ystart<(pass + 1) * 4096; ystart+=EXHAUSTIVE_ROWS){
+                for (size_t i=0; i<strippixels; i++){
+                    uint32_t color = (((uint32_t)((ystart - pass * 4096) * width) + (uint32_t)i) * multiplier) & 0xffffff;
+                    input[(i * 4)] = (uint8_t)(color >> 16);
+                    input[(i * 4) + 1] = (uint8_t)(color >> 8);
+                    input[(i * 4) + 2] = (uint8_t)color;
+                    input[(i * 4) + 3] = 255;
+                    int x = (int)(i % width);
+                    int y = ystart + (int)(i / width);
+                    referenceconvertpixel(&pipe, mode, &input[i * 4], &reference[i * 3], x, y, width, height);
+                }
+                for (int k=0; k<count; k++){
+                    exhaustivekernel* kernel = &kernels[k];
+                    if (kernel->rgb){
+                        for (size_t i=0; i<strippixels; i++){
+                            memcpy(&image[i * 3], &input[i * 4], 3);
+                        }
+                        ntscj_convert_rows_rgb(kernel->context, image, (size_t)width * 3, width, height, ystart, EXHAUSTIVE_ROWS, (ntscj_direction)mode);
+                        for (size_t i=strippixels; i-->0;){
+                            memmove(&image[i * 4], &image[i * 3], 3);
+                            image[(i * 4) + 3] = 255;
+                        }
+                    }
+                    else {
+                        memcpy(image, input, strippixels * 4);
+                        ntscj_convert_rows(kernel->context, image, (size_t)width * 4, width, height, ystart, EXHAUSTIVE_ROWS, (ntscj_direction)mode);
+                    }
+                    for (size_t i=0; i<strippixels; i++){
+                        for (int c=0; c<3; c++){
+                            int difference = abs((int)image[(i * 4) + c] - (int)reference[(i * 3) + c]);
+                            if (difference == 0) continue;
+                            kernel->mismatches++;
+                            if (difference > kernel->deviation) kernel->deviation = difference;
+                        }
+                    }
+                    if (k == 0){
+                        memcpy(first, image, strippixels * 4);
+                    }
+                    else if (kernel->tabled){
+                        for (size_t i=0; i<strippixels; i++){
+                            if (memcmp(&image[i * 4], &first[i * 4], 4) != 0) kernel->divergences++;
+                        }
+                    }
+                }
+            }
+        }
+        
+        long long channels = 3LL * width * height;
+        for (int k=0; k<count; k++){
+            exhaustivekernel* kernel = &kernels[k];
+            bool failed = (kernel->bounded && ((kernel->deviation > kernel->allowed) || (kernel->mismatches > (long long)(kernel->allowedrate * channels)))) ||
+                          (kernel->divergences > 0);
+            if (report != NULL){
+                fprintf(report, "%s, every color %i times, %s: %lld of %lld channels differ from the reference, by at most %i",
+                        (mode == 1) ? "ntscj-to-srgb" : "srgb-to-ntscj", passes, kernel->label, kernel->mismatches, channels, kernel->deviation);
+                if (kernel->bounded) fprintf(report, " (allowed %.4g%%, by %i)", kernel->allowedrate * 100.0, kernel->allowed);
+                if (kernel->tabled && (k > 0)) fprintf(report, ", %lld pixels differ from %s", kernel->divergences, kernels[0].label);
+                fprintf(report, "%s\n", failed ? " FAILED" : "");
+            }
+            if (failed) failures++;
+            ntscj_free_context(kernel->context);
+        }
+        ntscj_free_lut(lut);
+    }
+    free(input);
+    free(reference);
+    free(first);
+    free(image);
+    return failures;
+}
+
+long long ntscj_self_test(FILE* report){
+    ntscj_init();
+    long long mismatches = selftestdither(report);
+    ntscj_options options;
+    ntscj_default_options(&options);
+    for (int mode=1; mode<=2; mode++){
+        mismatches += selftestimage(report, mode, &options, "");
+    }
+    options.memo = true;
+    mismatches += selftestimage(report, 1, &options, ", memo");
+    mismatches += selftestmemodirections(report);
+    options.skiptransparent = true;
+    mismatches += selftestimage(report, 1, &options, ", memo, skip transparent");
+    options.memo = false;
+    mismatches += selftestimage(report, 1, &options, ", skip transparent");
+    mismatches += selftestrects(report, &options, ", skip transparent");
+    options.skiptransparent = false;
+    mismatches += selftestrects(report, &options, "");
+    options.memo = true;
+    mismatches += selftestrects(report, &options, ", memo");
+    mismatches += selftestrgb(report, &options, ", memo");
+    options.memo = false;
+    options.fixed = true;
+    mismatches += selftestrects(report, &options, "");
+    mismatches += selftestrgb(report, &options, "");
+    options.fixed = false;
+    mismatches += selftestrgb(report, &options, "");
+    mismatches += selftestprofiles(report);
+    options.profile = ntscj_find_profile("pal");
+    mismatches += selftestimage(report, 1, &options, ", pal profile");
+    options.profile = ntscj_find_profile("ntscj-broadcast");
+    mismatches += selftestimage(report, 2, &options, ", ntscj-broadcast profile");
+    options.profile = NULL;
+    mismatches += selftesttransfers(report);
+    options.decode = NTSCJ_TRANSFER_GAMMA22;
+    options.encode = NTSCJ_TRANSFER_BT1886;
+    mismatches += selftestimage(report, 1, &options, ", 2.2 decode, bt1886 encode");
+    options.memo = true;
+    options.decode = NTSCJ_TRANSFER_BT1886;
+    options.encode = NTSCJ_TRANSFER_GAMMA22;
+    mismatches += selftestimage(report, 2, &options, ", memo, bt1886 decode, 2.2 encode");
+    options.memo = false;
+    options.decode = NTSCJ_TRANSFER_SRGB;
+    options.encode = NTSCJ_TRANSFER_SRGB;
+    mismatches += selftestimage16(report, 1, false);
+    mismatches += selftestimage16(report, 2, true);
+    for (int mode=1; mode<=2; mode++){
+        mismatches += selftestlut(report, mode, false);
+        mismatches += selftestlut(report, mode, true);
+    }
+    return mismatches;
+}
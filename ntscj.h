@@ -0,0 +1,208 @@
+/*- libntscj
+ *
+ * COPYRIGHT: 2023 by Chris Bussard
+ * LICENSE: GPLv3
+ *
+ * The color conversion engine behind ntscjpng, without any of the png plumbing.
+ * Converts 8-bit (or 16-bit) sRGBA or 8-bit sRGB pixels in memory between the NTSC-J and sRGB color gamuts using the Bradford method,
+ * with Martin Roberts' quasirandom dithering back down to 8 (or 16) bits.
+ * Other television gamuts can be converted to and from sRGB the same way by picking a gamut profile.
+ *
+ * Typical use:
+ *   ntscj_options options;
+ *   ntscj_default_options(&options);
+ *   options.threads = 4;
+ *   ntscj_context* context = ntscj_create_context(&options);
+ *   for each image:
+ *       ntscj_convert_rows(context, pixels, stride, width, height, 0, height, NTSCJ_NTSCJ_TO_SRGB);
+ *   ntscj_free_context(context);
+ * or, for a one-off:
+ *   ntscj_convert_rgba8(pixels, width, height, stride, NTSCJ_NTSCJ_TO_SRGB, NULL);
+ *
+ * The lookup tables are built once per process, the first time they're needed (or by ntscj_init()), and shared by every context.
+ * A context holds the per-thread scratch space and must only be used by one caller at a time;
+ * use one context per thread to convert several images at once.
+ *
+ */
+
+#ifndef NTSCJ_H
+#define NTSCJ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NTSCJ_VERSION "1.1.0"
+
+// most threads a context will split an image across
+#define NTSCJ_MAX_THREADS 256
+
+typedef enum ntscj_direction {
+    NTSCJ_NTSCJ_TO_SRGB = 1,
+    NTSCJ_SRGB_TO_NTSCJ = 2
+} ntscj_direction;
+
+// Largest 3D LUT we'll make or load, in grid points per axis.
+#define NTSCJ_MAX_LUT_SIZE 256
+
+typedef struct ntscj_lut ntscj_lut;
+
+// A color gamut: CIE 1931 xy chromaticities of its red, green, and blue primaries and its white point.
+typedef struct ntscj_gamut {
+    double red[2];
+    double green[2];
+    double blue[2];
+    double white[2];
+} ntscj_gamut;
+
+// A gamut with its Bradford matrices to and from sRGB (D65) worked out. The directions then mean this gamut wherever they say NTSC-J.
+typedef struct ntscj_profile ntscj_profile;
+
+// How sample values are decoded to linear light and encoded back.
+typedef enum ntscj_transfer {
+    NTSCJ_TRANSFER_SRGB = 0, // the piecewise sRGB curve
+    NTSCJ_TRANSFER_GAMMA22 = 1, // a pure 2.2 power curve
+    NTSCJ_TRANSFER_BT1886 = 2 // BT.1886 with the display's black at 0, which is a pure 2.4 power curve
+} ntscj_transfer;
+
+typedef struct ntscj_options {
+    int threads; // split each call into this many row bands converted in parallel (default 1)
+    bool memo; // remember the result for each unique input color; faster for images with few colors (default false)
+    bool exact; // use pow() for the linear to sRGB step instead of the interpolated table (default false)
+    bool simd; // use the SSE2/AVX2/NEON matrix kernel if the CPU has one (default true)
+    bool fixed; // use the all-integer path instead, which gives the same output on every compiler and CPU; ignores memo, exact, and simd (default false)
+    bool skiptransparent; // leave pixels with alpha 0 exactly as they are instead of converting them (default false)
+    bool gpu; // convert on an OpenCL GPU if built with NTSCJ_WITH_OPENCL and there is one; implies fixed, and the output is the same either way (default false)
+    const ntscj_lut* lut; // if not NULL, interpolate this 3D LUT instead of doing the gamut conversion, ignoring the direction, memo, exact, fixed, simd, and gpu.
+                          // The LUT must outlive every context made with it. (default NULL)
+    bool trilinear; // interpolate the LUT trilinearly instead of tetrahedrally (default false)
+    const ntscj_profile* profile; // the gamut to convert sRGB to and from; NULL for "ntscj" (default NULL)
+    ntscj_transfer decode; // how the input is decoded to linear light (default NTSCJ_TRANSFER_SRGB)
+    ntscj_transfer encode; // how the output is encoded from linear light (default NTSCJ_TRANSFER_SRGB)
+                           // The fixed-point tables are sRGB only, so fixed and gpu are ignored unless both are sRGB. A lut ignores both.
+} ntscj_options;
+
+// Pixels that had to be clamped because they fell outside the destination gamut.
+typedef struct ntscj_clipcount {
+    long long low; // pixels with at least one channel below 0
+    long long high; // pixels with at least one channel above 1
+} ntscj_clipcount;
+
+typedef struct ntscj_context ntscj_context;
+
+// Build the shared lookup tables and pick the matrix kernel. Safe to call more than once, from any thread.
+// ntscj_create_context() and ntscj_convert_rgba8() call this for you.
+void ntscj_init(void);
+
+void ntscj_default_options(ntscj_options* options);
+
+// Look up a gamut profile by name. Returns NULL if there's no such profile. The built-in ones are
+// "ntscj" (NTSC 1953 primaries, 9300K+27mpcd white, as on Japanese receivers; the default), "ntscj-broadcast" (9300K+8mpcd white),
+// "d93" (CIE 9300K white), "ntsc1953" (illuminant C white), "smpte-c", and "pal" (EBU primaries), the last two with D65 white.
+const ntscj_profile* ntscj_find_profile(const char* name);
+// Work out the matrices for gamut and keep them under name for the rest of the process. The name is copied.
+// If name is already taken, returns that profile if it has the same gamut, otherwise NULL.
+// Also returns NULL if out of memory, or if the gamut is degenerate or too far from sRGB for the fixed-point path.
+const ntscj_profile* ntscj_add_profile(const char* name, const ntscj_gamut* gamut);
+// profile may be NULL for the default
+const char* ntscj_profile_name(const ntscj_profile* profile);
+const ntscj_gamut* ntscj_profile_gamut(const ntscj_profile* profile);
+
+// Name of the matrix kernel a context with these options will use: "scalar", "sse2", "avx2", "neon", or "fixed".
+const char* ntscj_kernel_name(const ntscj_options* options);
+
+// Returns NULL if out of memory. options may be NULL for the defaults.
+ntscj_context* ntscj_create_context(const ntscj_options* options);
+void ntscj_free_context(ntscj_context* context);
+
+// true if the gpu option was set and the context got a device; otherwise it converts on the CPU
+bool ntscj_context_uses_gpu(const ntscj_context* context);
+
+// Gamut convert rows ystart through ystart+rowcount-1 of an 8-bit RGBA image in place. Alpha is not touched.
+// rows points at row ystart, not at the top of the image; stride is the distance in bytes between rows.
+// height is the height of the whole image: the dither depends on each pixel's position in the whole image,
+// so an image converted in strips comes out exactly the same as one converted all at once.
+void ntscj_convert_rows(ntscj_context* context, uint8_t* rows, size_t stride, int width, int height, int ystart, int rowcount, ntscj_direction direction);
+
+// ntscj_convert_rows() for 16-bit RGBA in the machine's byte order, dithered to 16 bits, so nothing is lost to 8-bit rounding.
+// If linear is set the samples are linear light rather than sRGB encoded (not premultiplied, unlike libpng's PNG_FORMAT_LINEAR_RGB_ALPHA);
+// the output is always sRGB encoded. Always uses the floating point pipeline: memo, fixed, gpu, and lut don't apply.
+void ntscj_convert_rows16(ntscj_context* context, uint16_t* rows, size_t stride, int width, int height, int ystart, int rowcount, ntscj_direction direction, bool linear);
+
+// A rectangle of an image, in pixels.
+typedef struct ntscj_rect {
+    int x;
+    int y;
+    int width;
+    int height;
+} ntscj_rect;
+
+// ntscj_convert_rows() restricted to count rectangles in whole image coordinates, leaving every other pixel as it was.
+// Only the parts of them within rows ystart through ystart+rowcount-1 are converted. rects may be NULL for the whole image.
+// If tilesize isn't 0, the rectangles are also cut into blocks on a tilesize grid aligned to the top left of the image;
+// otherwise they're cut into a band of rows per thread. Either way the context's threads take the pieces in turn.
+// Rectangles are clipped to the image and must not overlap. Pixels are still dithered by their position in the whole image,
+// so there are no seams, and converting an image in pieces gives the same output as converting it all at once.
+void ntscj_convert_rects(ntscj_context* context, uint8_t* rows, size_t stride, int width, int height, int ystart, int rowcount,
+                         const ntscj_rect* rects, int count, int tilesize, ntscj_direction direction);
+// The same for 16-bit RGBA, as in ntscj_convert_rows16().
+void ntscj_convert_rects16(ntscj_context* context, uint16_t* rows, size_t stride, int width, int height, int ystart, int rowcount,
+                           const ntscj_rect* rects, int count, int tilesize, ntscj_direction direction, bool linear);
+
+// ntscj_convert_rects() that also leaves alone every pixel where mask is 0. The mask is one byte per pixel,
+// starting at row ystart like rows, with maskstride bytes between rows.
+void ntscj_convert_masked(ntscj_context* context, uint8_t* rows, size_t stride, const uint8_t* mask, size_t maskstride, int width, int height, int ystart, int rowcount,
+                          const ntscj_rect* rects, int count, int tilesize, ntscj_direction direction);
+void ntscj_convert_masked16(ntscj_context* context, uint16_t* rows, size_t stride, const uint8_t* mask, size_t maskstride, int width, int height, int ystart, int rowcount,
+                            const ntscj_rect* rects, int count, int tilesize, ntscj_direction direction, bool linear);
+
+// ntscj_convert_rows(), ntscj_convert_rects(), and ntscj_convert_masked() for 8-bit RGB rows, 3 bytes per pixel with no alpha.
+// The output is the same as for those pixels in an RGBA image. skiptransparent doesn't apply, and the gpu isn't used.
+void ntscj_convert_rows_rgb(ntscj_context* context, uint8_t* rows, size_t stride, int width, int height, int ystart, int rowcount, ntscj_direction direction);
+void ntscj_convert_rects_rgb(ntscj_context* context, uint8_t* rows, size_t stride, int width, int height, int ystart, int rowcount,
+                             const ntscj_rect* rects, int count, int tilesize, ntscj_direction direction);
+void ntscj_convert_masked_rgb(ntscj_context* context, uint8_t* rows, size_t stride, const uint8_t* mask, size_t maskstride, int width, int height, int ystart, int rowcount,
+                              const ntscj_rect* rects, int count, int tilesize, ntscj_direction direction);
+
+// Gamut convert a whole 8-bit RGBA image in place with a temporary context. stride 0 means width * 4.
+// options may be NULL for the defaults. Returns false if out of memory.
+bool ntscj_convert_rgba8(uint8_t* buffer, int width, int height, size_t stride, ntscj_direction direction, const ntscj_options* options);
+
+// Gamut convert the colors of a palette in place, rounding to nearest instead of dithering.
+// entrysize is 3 for RGB entries or 4 for RGBA; alpha is not touched. Clamped entries are counted like pixels.
+void ntscj_convert_palette(ntscj_context* context, uint8_t* entries, int count, size_t entrysize, ntscj_direction direction);
+
+// Clamped pixel counts since the context was created or last reset.
+ntscj_clipcount ntscj_get_clip_counts(const ntscj_context* context);
+void ntscj_reset_clip_counts(ntscj_context* context);
+
+// A 3D LUT of size^3 sRGB colors, red changing fastest, then green, then blue (the order of a .cube file).
+// values are copied, and clamped to 0-1. Returns NULL if out of memory or size isn't 2 to NTSCJ_MAX_LUT_SIZE.
+ntscj_lut* ntscj_create_lut(int size, const float* values);
+// A 3D LUT of the gamut conversion itself, without dithering, sampled at size points per axis.
+// Follows the exact, profile, decode, and encode options; options may be NULL for the defaults.
+ntscj_lut* ntscj_make_lut(int size, ntscj_direction direction, const ntscj_options* options);
+int ntscj_lut_size(const ntscj_lut* lut);
+const float* ntscj_lut_values(const ntscj_lut* lut);
+void ntscj_free_lut(ntscj_lut* lut);
+
+// Check the tabled and vectorized fast paths against the plain reference code, writing a line per check to report if it isn't NULL.
+// Returns the number of mismatches, which should be 0.
+long long ntscj_self_test(FILE* report);
+// Run all 16.7M 24-bit colors, each at passes different dither positions, through every kernel this build and machine have
+// (scalar, SIMD, threaded, memo, RGB, exact, fixed, gpu, and a 65-point LUT), and compare each one to the conversion done pixel by pixel
+// with the transfer functions themselves. Writes each kernel's mismatch count and largest per-channel deviation to report if it isn't NULL.
+// Only the profile, decode, and encode options are used; options may be NULL for the defaults. Takes a few seconds a pass.
+// Returns the number of kernels that drifted further than they should, which should be 0.
+long long ntscj_self_test_exhaustive(FILE* report, const ntscj_options* options, int passes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NTSCJ_H */
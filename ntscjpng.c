@@ -6,24 +6,39 @@
  * Convert a nominally sRGB png that in reality uses the NTSC-J color gamut to the sRGB color gamut using the Bradford method.
  * Principally intended for color correcting texture assets for Final Fantasy 7 & 8.
  * Usage:
- * ntscjpng input.png output.png
- * where input.png uses 8-bit sRGB or sRGBA and output.png will be 8-bit sRGBA.
+ * ntscjpng [options] mode input.png output.png [input2.png output2.png ...]
+ * where mode is ntscj-to-srgb or srgb-to-ntscj, input.png uses 8-bit sRGB or sRGBA and output.png will be 8-bit sRGBA.
  * 
  * png plumbing shamelessly borrowed from png2png example by John Cunningham Bowler (copyright waived).
  * quasirandom dithering method devised by Martin Roberts.
  * 
  * To build on Linux:
  * install libpng-dev >= 1.6.0
- * gcc -o ntscjpng ntscjpng.c -lpng16 -lz -lm
+ * gcc -o ntscjpng ntscjpng.c ntscj.c -lpng16 -lz -lm -pthread
+ * (zlib headers are needed too; libpng-dev pulls in zlib1g-dev)
+ * add -DNTSCJ_WITH_OPENCL and -lOpenCL for the --gpu backend
  * 
  */
 
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "ntscj.h"
 
 /* Normally use <png.h> here to get the installed libpng, but this is done to
  * ensure the code picks up the local libpng implementation:
@@ -33,215 +48,2515 @@
 #if defined(PNG_SIMPLIFIED_READ_SUPPORTED) && \
     defined(PNG_SIMPLIFIED_WRITE_SUPPORTED)
 
-// precomputed NTSC-J to SRGB color gamut conversion using Bradford Method
-// Note:
-// NTSC-J television sets had a whitepoint of 9300K+27mpcd (x=0.281, y=0.311)
-// NTSC-J broadcasts had a whitepoint of 9300K+8mpcd (x=0.2838 y=0.2981)
-// And neither of those is quite the same as CIE 9300K (x=0.2848 y=0.2932 or x=0.28315, y=0.29711, depending on which source you consult; discrepancy might relate to rivision of Planck's Law constants???)
-// This matrix uses 9300K+27mpcd for NTSC-J white point and x=0.312713, y=0.329016 for D65 white point
-
-const float NTSCJtoSRGBConversionMatrix[3][3] = {
-    {1.34756301456925, -0.276463760747096, -0.071099263267176},
-    {-0.031150036968175, 0.956512223260545, 0.074637860817515},
-    {-0.024443490594835, -0.048150182045316, 1.07259361295816}
-};
-
-const float SRGBtoNTSCJConversionMatrix[3][3] = {
-    {0.747740261849856, 0.217853505133354, 0.034406264690912},
-    {0.022941129531242, 1.04849963723505, -0.071440739296512},
-    {0.018070185951324, 0.052033179887888, 0.929896593506351}
-};
-
-
-// clamp a float between 0.0 and 1.0
-float clampfloat(float input){
-    if (input < 0.0) return 0.0;
-    if (input > 1.0) return 1.0;
-    return input;
-}
-
-// convert a 0-1 float value to 0-255 png_byte value with Martin Roberts' quasirandom dithering
-// see: https://extremelearning.com.au/unreasonable-effectiveness-of-quasirandom-sequences/
-// Aside from being just beautifully elegant, this dithering method is also perfect for our use case,
-// in which our input might be might be a "swizzled" texture.
-// These pose a problem for many other dithering methods.
-// Any kind of error diffusion will diffuse error across swizzled tile boundaries.
-// Even plain old ordered dithering is locally wrong where swizzled tile boundaries
-// often don't line up with the Bayer matrix boundaries.
-// But quasirandom doesn't care where you cut and splice it; it's still balanced.
-// (Blue noise would work too, but that's a huge amount of overhead, while this is a very short function.)
-png_byte quasirandomdither(float input, int x, int y){
-    x++; // avoid x=0
-    y++; // avoid y=0
-    double dummy;
-    float dither = modf(((float)x * 0.7548776662) + ((float)y * 0.56984029), &dummy);
-    if (dither < 0.5){
-        dither = 2.0 * dither;
-    }
-    else if (dither > 0.5) {
-        dither = 2.0 - (2.0 * dither);
-    }
-    // if we ever get exactly 0.5, don't touch it; otherwise we might end up adding 1.0 to a black that means transparency.
-    int output = (int)((input * 255.0) + dither);
-    if (output > 255) output = 255;
-    if (output < 0) output = 0;
-    return (png_byte)output;
-}
-
-// sRGB gamma functions
-float togamma(float input){
-    if (input <= 0.0031308){
-        return clampfloat(input * 12.92);
-    }
-    return clampfloat((1.055 * pow(input, (1.0/2.4))) - 0.055);
-}
-float tolinear(float input){
-    if (input <= 0.04045){
-        return clampfloat(input / 12.92);
-    }
-    return clampfloat(pow((input + 0.055) / 1.055, 2.4));
+// wall clock time in seconds, for --stats and bench
+double secondsnow(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + ((double)now.tv_nsec * 1.0e-9);
 }
 
-int main(int argc, const char **argv){
-   
-   int result = 1;
+// How to compress the output png. Only used when custom is set; otherwise libpng's defaults apply and
+// the whole-image path can use the simplified API.
+typedef struct pngprofile {
+    bool custom;
+    int level; // zlib compression level 0-9, or -1 for libpng's default
+    int strategy; // zlib strategy, or -1 for libpng's default
+    int filters; // PNG_FILTER_ flags, or 0 for libpng's default
+} pngprofile;
 
-   int mode = 0;
-   if (argc == 4){
-      if (strcmp(argv[1], "ntscj-to-srgb") == 0){
-        mode = 1;
+// Settings that apply to every file in the run.
+typedef struct runsettings {
+    bool stream; // convert a strip of rows at a time instead of reading in the whole image
+    bool printstats; // print a JSON line of filestats for each file instead of the usual progress message
+    pngprofile profile;
+    int rawwidth; // nonzero to read and write headerless RGBA8 of this size instead of png
+    int rawheight;
+    bool video; // with rawwidth: read frames of that size until the input runs out instead of just one
+    const char* cachedir; // non-NULL to look up and store results in a content-addressed cache
+    bool palette; // convert the palette of colormapped pngs and write them back colormapped
+    bool cachelink; // hard link cache hits to the output instead of copying
+    bool sixteenbit; // read at up to 16 bits per channel and write 16-bit output
+    bool rgba; // read every 8-bit png as RGBA, even ones with no alpha, which otherwise stay RGB
+    bool analyze; // convert without writing anything, and report what would change
+    int tilesize; // nonzero to convert in blocks this size, spread over the threads, instead of row bands
+    const ntscj_rect* rects; // non-NULL to convert only these rectangles of each image
+    int rectcount;
+    const uint8_t* mask; // non-NULL to convert only the pixels where this is nonzero (one byte per pixel)
+    int maskwidth; // the images have to be this size
+    int maskheight;
+    unsigned long long cacheseed; // hash of everything besides the input and mode that affects the output bytes
+} runsettings;
+
+const runsettings defaultsettings = {false, false, {false, -1, -1, 0}, 0, 0, false, NULL, false, false, false, false, false, 0, NULL, 0, NULL, 0, 0, 0};
+
+// What --stats reports for each file.
+typedef struct filestats {
+    int width;
+    int height;
+    double readbegin; // seconds in png_image_begin_read_from_memory (or reading the header, when streaming)
+    double readfinish; // seconds in png_image_finish_read (or reading rows, when streaming)
+    double convert; // seconds in the conversion loop
+    double write; // seconds encoding and writing the png (or writing rows, when streaming)
+    ntscj_clipcount clips;
+    bool cached; // copied from the cache instead of converted
+    long long frames; // frames converted, for --video
+    long long changed; // pixels the conversion changed, for --analyze
+    int maxdelta; // largest change in any color channel, for --analyze
+} filestats;
+
+// Everything that gets reused from one file to the next in a batch.
+typedef struct workspace {
+    png_bytep buffer;
+    size_t buffersize;
+    png_bytep encoded; // the output png, encoded in memory before it's written out in one go
+    size_t encodedsize;
+    int threads;
+    bool parallel; // other workspaces are converting other files at the same time
+    const runsettings* settings;
+    filestats stats; // for the current file
+    ntscj_context* context; // the conversion engine, with its per-thread scratch space
+} workspace;
+
+// Returns false if the library couldn't make a context. If it couldn't make one with the memo, warns and makes one without.
+bool initworkspace(workspace* ws, const ntscj_options* options){
+    ws->buffer = NULL;
+    ws->buffersize = 0;
+    ws->encoded = NULL;
+    ws->encodedsize = 0;
+    ws->threads = options->threads;
+    ws->parallel = false;
+    ws->settings = &defaultsettings;
+    memset(&ws->stats, 0, sizeof ws->stats);
+    ws->context = ntscj_create_context(options);
+    if ((ws->context == NULL) && options->memo){
+        // a missing memo just means a slower worker
+        fprintf(stderr, "ntscjpng: out of memory for color memo, continuing without it\n");
+        ntscj_options nomemo = *options;
+        nomemo.memo = false;
+        ws->context = ntscj_create_context(&nomemo);
+    }
+    // only say so once, not once per file worker
+    static bool warnedgpu = false;
+    if ((ws->context != NULL) && options->gpu && !ntscj_context_uses_gpu(ws->context) && !warnedgpu){
+        fprintf(stderr, "ntscjpng: no OpenCL GPU available, converting on the CPU instead (the output is the same)\n");
+        warnedgpu = true;
+    }
+    return (ws->context != NULL);
+}
+
+void freeworkspace(workspace* ws){
+    free(ws->buffer);
+    ws->buffer = NULL;
+    ws->buffersize = 0;
+    free(ws->encoded);
+    ws->encoded = NULL;
+    ws->encodedsize = 0;
+    ntscj_free_context(ws->context);
+    ws->context = NULL;
+}
+
+// Make sure the workspace buffer holds at least size bytes. Only ever grows.
+bool reserveworkspace(workspace* ws, size_t size){
+    if (size <= ws->buffersize) return true;
+    png_bytep newbuffer = realloc(ws->buffer, size);
+    if (newbuffer == NULL) return false;
+    ws->buffer = newbuffer;
+    ws->buffersize = size;
+    return true;
+}
+
+// Gamut convert a strip of rows of an 8-bit RGBA (channels 4) or RGB (channels 3) image in place, split into row bands across the workspace's threads.
+// strip holds rows stripy through stripy+striprows-1 of an image that is height rows tall.
+void convertstrip(png_bytep strip, int width, int height, int stripy, int striprows, int channels, int mode, workspace* ws){
+    const runsettings* settings = ws->settings;
+    size_t stride = (size_t)width * channels;
+    if (settings->mask != NULL){
+        const uint8_t* mask = &settings->mask[(size_t)stripy * width];
+        if (channels == 3){
+            ntscj_convert_masked_rgb(ws->context, strip, stride, mask, width, width, height, stripy, striprows, settings->rects, settings->rectcount, settings->tilesize, (ntscj_direction)mode);
+        }
+        else {
+            ntscj_convert_masked(ws->context, strip, stride, mask, width, width, height, stripy, striprows, settings->rects, settings->rectcount, settings->tilesize, (ntscj_direction)mode);
+        }
+    }
+    else if ((settings->rects != NULL) || (settings->tilesize > 0)){
+        if (channels == 3){
+            ntscj_convert_rects_rgb(ws->context, strip, stride, width, height, stripy, striprows, settings->rects, settings->rectcount, settings->tilesize, (ntscj_direction)mode);
+        }
+        else {
+            ntscj_convert_rects(ws->context, strip, stride, width, height, stripy, striprows, settings->rects, settings->rectcount, settings->tilesize, (ntscj_direction)mode);
+        }
+    }
+    else if (channels == 3){
+        ntscj_convert_rows_rgb(ws->context, strip, stride, width, height, stripy, striprows, (ntscj_direction)mode);
+    }
+    else {
+        ntscj_convert_rows(ws->context, strip, stride, width, height, stripy, striprows, (ntscj_direction)mode);
+    }
+}
+
+// Gamut convert a whole 8-bit RGBA or RGB image in place.
+void convertimage(png_bytep buffer, int width, int height, int channels, int mode, workspace* ws){
+    convertstrip(buffer, width, height, 0, height, channels, mode, ws);
+}
+
+// The simplified API format to read an 8-bit png in: RGB if it has no alpha channel or tRNS chunk, so there's no dummy alpha
+// to carry through the conversion and then compress, unless --rgba. Gray stays RGB either way, since the conversion gives it color.
+png_uint_32 readformat(const png_image* image, const runsettings* settings){
+    return (settings->rgba || ((image->format & PNG_FORMAT_FLAG_ALPHA) != 0)) ? PNG_FORMAT_RGBA : PNG_FORMAT_RGB;
+}
+
+// With --mask, every image has to be the size of the mask. Returns false, after saying so, if this one isn't.
+bool checkmasksize(const workspace* ws, const char* inputfile, int width, int height){
+    const runsettings* settings = ws->settings;
+    if ((settings->mask == NULL) || ((width == settings->maskwidth) && (height == settings->maskheight))) return true;
+    fprintf(stderr, "ntscjpng: %s is %ix%i but the mask is %ix%i\n", inputfile, width, height, settings->maskwidth, settings->maskheight);
+    return false;
+}
+
+// libpng error plumbing for when we can't use the simplified API
+typedef struct pngerror {
+    jmp_buf jump;
+    char message[256];
+} pngerror;
+
+void pngerrorhandler(png_structp png, png_const_charp message){
+    pngerror* error = png_get_error_ptr(png);
+    snprintf(error->message, sizeof error->message, "%s", message);
+    longjmp(error->jump, 1);
+}
+
+void pngwarninghandler(png_structp png, png_const_charp message){
+    // the simplified API ignores warnings too
+    (void)png;
+    (void)message;
+}
+
+// Set the compression options for a png we're writing.
+void applypngprofile(png_structp png, const pngprofile* profile){
+    if ((profile == NULL) || !profile->custom) return;
+    if (profile->level >= 0){
+        png_set_compression_level(png, profile->level);
+    }
+    if (profile->strategy >= 0){
+        png_set_compression_strategy(png, profile->strategy);
+    }
+    if (profile->filters != 0){
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, profile->filters);
+    }
+}
+
+// true if this machine stores the low byte of a uint16_t first, so libpng has to swap 16-bit samples for us
+bool littleendian(){
+    const uint16_t one = 1;
+    return (*(const uint8_t*)&one == 1);
+}
+
+// Write an sRGB image with the full libpng API so we can control compression. Returns true on success.
+// Writes the same chunks as png_image_write_to_memory does for our images.
+// colortype is PNG_COLOR_TYPE_RGB_ALPHA, PNG_COLOR_TYPE_RGB, or PNG_COLOR_TYPE_PALETTE, and bitdepth is 8 or 16 (8 for palettes).
+// 16-bit samples are in the machine's byte order. For palettes, buffer is one byte per pixel indexing colormapentries RGBA colormap entries.
+bool writepngfile(const char* outputfile, png_bytep buffer, int width, int height, int colortype, int bitdepth, png_const_bytep colormap, int colormapentries, const pngprofile* profile){
+    FILE* volatile output = NULL;
+    png_structp volatile png = NULL;
+    png_infop volatile info = NULL;
+    volatile bool result = false;
+    
+    pngerror error;
+    if (setjmp(error.jump)){
+        fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, error.message);
+        result = false;
+        goto cleanup;
+    }
+    
+    output = fopen(outputfile, "wb");
+    if (output == NULL){
+        fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+        goto cleanup;
+    }
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, &error, pngerrorhandler, pngwarninghandler);
+    if (png != NULL){
+        info = png_create_info_struct(png);
+    }
+    if (info == NULL){
+        fprintf(stderr, "ntscjpng: out of memory writing %s\n", outputfile);
+        goto cleanup;
+    }
+    png_init_io(png, output);
+    applypngprofile(png, profile);
+    int channels = (colortype == PNG_COLOR_TYPE_PALETTE) ? 1 : ((colortype == PNG_COLOR_TYPE_RGB) ? 3 : 4);
+    size_t rowbytes = (size_t)width * channels * (bitdepth / 8);
+    png_set_IHDR(png, info, width, height, bitdepth, colortype, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (colortype == PNG_COLOR_TYPE_PALETTE){
+        png_color palette[256];
+        png_byte alpha[256];
+        int alphacount = 0; // tRNS only needs to go up to the last entry that isn't opaque
+        for (int i=0; i<colormapentries; i++){
+            palette[i].red = colormap[(i * 4)];
+            palette[i].green = colormap[(i * 4) + 1];
+            palette[i].blue = colormap[(i * 4) + 2];
+            alpha[i] = colormap[(i * 4) + 3];
+            if (alpha[i] != 255) alphacount = i + 1;
+        }
+        png_set_PLTE(png, info, palette, colormapentries);
+        if (alphacount > 0){
+            png_set_tRNS(png, info, alpha, alphacount, NULL);
+        }
+    }
+    png_set_sRGB(png, info, PNG_sRGB_INTENT_PERCEPTUAL);
+    png_write_info(png, info);
+    if ((bitdepth == 16) && littleendian()){
+        png_set_swap(png);
+    }
+    for (int y=0; y<height; y++){
+        png_write_row(png, &buffer[ (size_t)y * rowbytes]);
+    }
+    png_write_end(png, info);
+    if (fflush(output) != 0){
+        fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+        goto cleanup;
+    }
+    result = true;
+    
+cleanup:
+    if (png != NULL){
+        png_structp p = png;
+        png_infop i = info;
+        png_destroy_write_struct(&p, (i != NULL) ? &i : NULL);
+    }
+    if (output != NULL){
+        if ((fclose(output) != 0) && result){
+            fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+            result = false;
+        }
+        if (!result){
+            remove(outputfile);
+        }
+    }
+    return result;
+}
+
+// An input file mapped into memory, so libpng decodes straight out of the page cache with no read() calls or copying.
+typedef struct mappedfile {
+    void* data;
+    size_t size;
+} mappedfile;
+
+// Returns false if the file can't be opened or mapped (it's empty, or a pipe, ...); the caller can still read it the usual way.
+bool mapfile(const char* name, mappedfile* file){
+    int descriptor = open(name, O_RDONLY);
+    if (descriptor < 0) return false;
+    struct stat info;
+    bool result = false;
+    if ((fstat(descriptor, &info) == 0) && S_ISREG(info.st_mode) && (info.st_size > 0)){
+        file->size = (size_t)info.st_size;
+        file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        result = (file->data != MAP_FAILED);
+    }
+    close(descriptor);
+    return result;
+}
+
+void unmapfile(mappedfile* file){
+    munmap(file->data, file->size);
+}
+
+// Encode the image with the simplified API into the workspace's output buffer, then write that to the file with a single fwrite().
+// The buffer only ever grows, so after the first few files of a batch it's always big enough.
+// Returns true on success.
+bool writeencodedfile(png_imagep image, const char* outputfile, png_const_bytep buffer, png_const_bytep colormap, workspace* ws){
+   // almost every png is smaller than its pixels, so start there and it'll rarely need a second try
+   size_t guess = PNG_IMAGE_SIZE(*image) + image->height + 4096;
+   for (;;){
+      if (ws->encodedsize < guess){
+         png_bytep newbuffer = realloc(ws->encoded, guess);
+         if (newbuffer == NULL){
+            fprintf(stderr, "ntscjpng: out of memory: %lu bytes\n", (unsigned long)guess);
+            return false;
+         }
+         ws->encoded = newbuffer;
+         ws->encodedsize = guess;
       }
-      else if (strcmp(argv[1], "srgb-to-ntscj") == 0){
-        mode = 2;
+      png_alloc_size_t size = ws->encodedsize;
+      if (png_image_write_to_memory(image, ws->encoded, &size, 0/*convert_to_8bit*/, buffer, 0/*row_stride*/, colormap)){
+         FILE* output = fopen(outputfile, "wb");
+         if (output == NULL){
+            fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+            return false;
+         }
+         bool result = (fwrite(ws->encoded, 1, size, output) == size);
+         if ((fclose(output) != 0) || !result){
+            fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+            remove(outputfile);
+            return false;
+         }
+         return true;
       }
+      // a failure that changed size means the buffer was too small, and size is how big it has to be
+      if (size <= ws->encodedsize){
+         fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, image->message);
+         return false;
+      }
+      guess = size;
    }
-   if (mode > 0){
-      
-      if (mode == 1){
-        printf("ntscjpng: converting %s from NTSC-J color gamut to sRGB color gamut and saving output to %s... ", argv[2], argv[3]);
+}
+
+// Read the whole png into memory, convert it, and write it. Returns true on success.
+bool convertwholefile(const char* inputfile, const char* outputfile, int mode, workspace* ws){
+   
+   bool result = false;
+   
+   png_image image;
+
+   /* Only the image structure version number needs to be set. */
+   memset(&image, 0, sizeof image);
+   image.version = PNG_IMAGE_VERSION;
+
+   // decode from a memory map where we can; where we can't, libpng reads the file itself
+   double start = secondsnow();
+   mappedfile mapped;
+   bool usemap = mapfile(inputfile, &mapped);
+   if (usemap ? png_image_begin_read_from_memory(&image, mapped.data, mapped.size) : png_image_begin_read_from_file(&image, inputfile)){
+      ws->stats.readbegin = secondsnow() - start;
+      ws->stats.width = image.width;
+      ws->stats.height = image.height;
+
+      // with --palette, colormapped input stays colormapped and we only convert the colormap
+      bool indexed = ws->settings->palette && ((image.format & PNG_FORMAT_FLAG_COLORMAP) != 0);
+      png_byte colormap[256 * 4];
+      image.format = indexed ? PNG_FORMAT_RGBA_COLORMAP : readformat(&image, ws->settings);
+      int channels = PNG_IMAGE_PIXEL_CHANNELS(image.format);
+
+      if (!checkmasksize(ws, inputfile, image.width, image.height)){
+         png_image_free(&image);
       }
+      else if (reserveworkspace(ws, PNG_IMAGE_SIZE(image))){
+         png_bytep buffer = ws->buffer;
+         
+         start = secondsnow();
+         if (png_image_finish_read(&image, NULL/*background*/, buffer, 0/*row_stride*/, indexed ? colormap : NULL)){
+             ws->stats.readfinish = secondsnow() - start;
+             
+             start = secondsnow();
+             if (indexed){
+                ntscj_convert_palette(ws->context, colormap, image.colormap_entries, 4, (ntscj_direction)mode);
+             }
+             else {
+                convertimage(buffer, image.width, image.height, channels, mode, ws);
+             }
+             ws->stats.convert = secondsnow() - start;
+             
+            start = secondsnow();
+            if (ws->settings->profile.custom){
+               // writepngfile() reports its own errors
+               result = indexed ? writepngfile(outputfile, buffer, image.width, image.height, PNG_COLOR_TYPE_PALETTE, 8, colormap, image.colormap_entries, &ws->settings->profile)
+                                : writepngfile(outputfile, buffer, image.width, image.height, (channels == 3) ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA, 8, NULL, 0, &ws->settings->profile);
+            }
+            else {
+               result = writeencodedfile(&image, outputfile, buffer, indexed ? colormap : NULL, ws);
+            }
+            ws->stats.write = secondsnow() - start;
+         }
+
+         else {
+            fprintf(stderr, "ntscjpng: read %s: %s\n", inputfile, image.message);
+         }
+      }
+
       else {
-          printf("ntscjpng: converting %s from sRGB color gamut to NTSC-J color gamut and saving output to %s... ", argv[2], argv[3]);
+         fprintf(stderr, "ntscjpng: out of memory: %lu bytes\n", (unsigned long)PNG_IMAGE_SIZE(image));
+
+         /* This is the only place where a 'free' is required; libpng does
+          * the cleanup on error and success, but in this case we couldn't
+          * complete the read because of running out of memory and so libpng
+          * has not got to the point where it can do cleanup.
+          */
+         png_image_free(&image);
       }
-      png_image image;
+   }
 
-      /* Only the image structure version number needs to be set. */
-      memset(&image, 0, sizeof image);
-      image.version = PNG_IMAGE_VERSION;
+   else {
+      /* Failed to read the input file argument: */
+      fprintf(stderr, "ntscjpng: %s: %s\n", inputfile, image.message);
+   }
+   
+   if (usemap){
+      unmapfile(&mapped);
+   }
+   return result;
+}
 
-      if (png_image_begin_read_from_file(&image, argv[2])){
-         png_bytep buffer;
+// rows per strip for each conversion thread when streaming
+#define STREAM_ROWS_PER_THREAD 16
 
-         /* Change this to try different formats!  If you set a colormap format
-          * then you must also supply a colormap below.
-          */
-         image.format = PNG_FORMAT_RGBA;
-
-         buffer = malloc(PNG_IMAGE_SIZE(image));
-
-         if (buffer != NULL){
-            if (png_image_finish_read(&image, NULL/*background*/, buffer, 0/*row_stride*/, NULL/*colormap for PNG_FORMAT_FLAG_COLORMAP */)){
-                
-                // ------------------------------------------------------------------------------------------------------------------------------------------
-                // Begin actual color conversion code
-                                
-                int width = image.width;
-                int height = image.height;
-                for (int y=0; y<height; y++){
-                    for (int x=0; x<width; x++){
-                        
-                        // read out from buffer and convert to float
-                        float redvalue = buffer[ ((y * width) + x) * 4]/255.0;
-                        float greenvalue = buffer[ (((y * width) + x) * 4) + 1 ]/255.0;
-                        float bluevalue = buffer[ (((y * width) + x) * 4) + 2 ]/255.0;
-                        // don't touch alpha value
-                        
-                        // to linear RGB
-                        redvalue = tolinear(redvalue);
-                        greenvalue = tolinear(greenvalue);
-                        bluevalue = tolinear(bluevalue);
-                        // The FF7 videos had banding near black when decoded with any piecewise "toe slope" gamma function, suggesting that a pure curve function was needed. May need to try this if such banding appears.
-                        //redvalue = clampfloat(pow(redvalue, 2.2));
-                        //greenvalue = clampfloat(pow(greenvalue, 2.2));
-                        //bluevalue = clampfloat(pow(bluevalue, 2.2));
-                        
-                        // Multiply by one of our pre-computed gamut conversion Bradford matrices
-                        float newred, newgreen, newblue;
-                        if (mode == 1){
-                            newred = NTSCJtoSRGBConversionMatrix[0][0] * redvalue + NTSCJtoSRGBConversionMatrix[0][1] * greenvalue + NTSCJtoSRGBConversionMatrix[0][2] * bluevalue;
-                            newgreen = NTSCJtoSRGBConversionMatrix[1][0] * redvalue + NTSCJtoSRGBConversionMatrix[1][1] * greenvalue + NTSCJtoSRGBConversionMatrix[1][2] * bluevalue;
-                            newblue = NTSCJtoSRGBConversionMatrix[2][0] * redvalue + NTSCJtoSRGBConversionMatrix[2][1] * greenvalue + NTSCJtoSRGBConversionMatrix[2][2] * bluevalue;
-                        }
-                        else {
-                            newred = SRGBtoNTSCJConversionMatrix[0][0] * redvalue + SRGBtoNTSCJConversionMatrix[0][1] * greenvalue + SRGBtoNTSCJConversionMatrix[0][2] * bluevalue;
-                            newgreen = SRGBtoNTSCJConversionMatrix[1][0] * redvalue + SRGBtoNTSCJConversionMatrix[1][1] * greenvalue + SRGBtoNTSCJConversionMatrix[1][2] * bluevalue;
-                            newblue = SRGBtoNTSCJConversionMatrix[2][0] * redvalue + SRGBtoNTSCJConversionMatrix[2][1] * greenvalue + SRGBtoNTSCJConversionMatrix[2][2] * bluevalue;
-                        }
-                        
-                        // clamp values to 0 to 1 range
-                        newred = clampfloat(newred);
-                        newgreen = clampfloat(newgreen);
-                        newblue = clampfloat(newblue);
-                                                
-                        // back to sRGB
-                        newred = togamma(newred);
-                        newgreen = togamma(newgreen);
-                        newblue = togamma(newblue);
-                                                
-                        // convert back to 0-255 with quasirandom dithering, and save back to buffer
-                        // use inverse x coord for red and inverse y coord for blue to decouple dither patterns across channels
-                        // see https://blog.kaetemi.be/2015/04/01/practical-bayer-dithering/
-                        buffer[ ((y * width) + x) * 4] = quasirandomdither(newred, width - x - 1, y);
-                        buffer[ (((y * width) + x) * 4) + 1 ] = quasirandomdither(newgreen, x, y);
-                        buffer[ (((y * width) + x) * 4) + 2 ] = quasirandomdither(newblue, x, height - y - 1);
-                                                
+enum { STREAM_FAILED = 0, STREAM_DONE = 1, STREAM_UNSUPPORTED = 2 };
+
+// Read, convert, and write the png a strip of rows at a time, so peak memory is a few rows instead of the whole image.
+// Asks libpng for the same 8-bit RGB or RGBA with sRGB gamma that the simplified API gives us.
+// Interlaced images can't be read a row at a time, so for those (and for palette images with --palette)
+// this gives up before writing anything and returns STREAM_UNSUPPORTED.
+int convertstreamingfile(const char* inputfile, const char* outputfile, int mode, workspace* ws){
+    
+    // everything touched after setjmp has to be volatile
+    FILE* volatile input = NULL;
+    FILE* volatile output = NULL;
+    png_structp volatile readpng = NULL;
+    png_infop volatile readinfo = NULL;
+    png_structp volatile writepng = NULL;
+    png_infop volatile writeinfo = NULL;
+    png_bytep* volatile rowpointers = NULL;
+    volatile int result = STREAM_FAILED;
+    volatile bool writing = false;
+    
+    pngerror error;
+    if (setjmp(error.jump)){
+        if (writing){
+            fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, error.message);
+        }
+        else {
+            fprintf(stderr, "ntscjpng: read %s: %s\n", inputfile, error.message);
+        }
+        result = STREAM_FAILED;
+        goto cleanup;
+    }
+    
+    input = fopen(inputfile, "rb");
+    if (input == NULL){
+        fprintf(stderr, "ntscjpng: %s: %s\n", inputfile, strerror(errno));
+        goto cleanup;
+    }
+    readpng = png_create_read_struct(PNG_LIBPNG_VER_STRING, &error, pngerrorhandler, pngwarninghandler);
+    if (readpng != NULL){
+        readinfo = png_create_info_struct(readpng);
+    }
+    if (readinfo == NULL){
+        fprintf(stderr, "ntscjpng: out of memory reading %s\n", inputfile);
+        goto cleanup;
+    }
+    png_init_io(readpng, input);
+    double start = secondsnow();
+    png_read_info(readpng, readinfo);
+    
+    // palette mode needs the whole-image path too, though an indexed image is small anyway
+    if ((png_get_interlace_type(readpng, readinfo) != PNG_INTERLACE_NONE) ||
+        (ws->settings->palette && (png_get_color_type(readpng, readinfo) == PNG_COLOR_TYPE_PALETTE))){
+        result = STREAM_UNSUPPORTED;
+        goto cleanup;
+    }
+    
+    // whatever we've got, turn it into 8-bit sRGB, with alpha if it has any (or tRNS) or if --rgba, as in readformat()
+    bool alpha = ws->settings->rgba || ((png_get_color_type(readpng, readinfo) & PNG_COLOR_MASK_ALPHA) != 0) || (png_get_valid(readpng, readinfo, PNG_INFO_tRNS) != 0);
+    int channels = alpha ? 4 : 3;
+    png_set_expand(readpng);
+    png_set_scale_16(readpng);
+    png_set_gray_to_rgb(readpng);
+    if (alpha){
+        png_set_add_alpha(readpng, 0xff, PNG_FILLER_AFTER);
+    }
+    png_set_alpha_mode(readpng, PNG_ALPHA_PNG, PNG_DEFAULT_sRGB);
+    png_read_update_info(readpng, readinfo);
+    ws->stats.readbegin = secondsnow() - start;
+    
+    int width = (int)png_get_image_width(readpng, readinfo);
+    int height = (int)png_get_image_height(readpng, readinfo);
+    ws->stats.width = width;
+    ws->stats.height = height;
+    if (!checkmasksize(ws, inputfile, width, height)) goto cleanup;
+    
+    int striprows = ws->threads * STREAM_ROWS_PER_THREAD;
+    if (striprows > height) striprows = height;
+    size_t rowbytes = (size_t)width * channels;
+    if (!reserveworkspace(ws, rowbytes * striprows)){
+        fprintf(stderr, "ntscjpng: out of memory: %lu bytes\n", (unsigned long)(rowbytes * striprows));
+        goto cleanup;
+    }
+    rowpointers = malloc(striprows * sizeof(png_bytep));
+    if (rowpointers == NULL){
+        fprintf(stderr, "ntscjpng: out of memory reading %s\n", inputfile);
+        goto cleanup;
+    }
+    for (int i=0; i<striprows; i++){
+        rowpointers[i] = &ws->buffer[rowbytes * i];
+    }
+    
+    writing = true;
+    output = fopen(outputfile, "wb");
+    if (output == NULL){
+        fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+        goto cleanup;
+    }
+    writepng = png_create_write_struct(PNG_LIBPNG_VER_STRING, &error, pngerrorhandler, pngwarninghandler);
+    if (writepng != NULL){
+        writeinfo = png_create_info_struct(writepng);
+    }
+    if (writeinfo == NULL){
+        fprintf(stderr, "ntscjpng: out of memory writing %s\n", outputfile);
+        goto cleanup;
+    }
+    png_init_io(writepng, output);
+    applypngprofile(writepng, &ws->settings->profile);
+    start = secondsnow();
+    png_set_IHDR(writepng, writeinfo, width, height, 8, alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    // same as the simplified API writes for 8-bit data
+    png_set_sRGB(writepng, writeinfo, PNG_sRGB_INTENT_PERCEPTUAL);
+    png_write_info(writepng, writeinfo);
+    ws->stats.write += secondsnow() - start;
+    
+    for (int y=0; y<height; y+=striprows){
+        int rows = (height - y < striprows) ? (height - y) : striprows;
+        writing = false;
+        start = secondsnow();
+        png_read_rows(readpng, rowpointers, NULL, rows);
+        double read = secondsnow();
+        convertstrip(ws->buffer, width, height, y, rows, channels, mode, ws);
+        double converted = secondsnow();
+        writing = true;
+        png_write_rows(writepng, rowpointers, rows);
+        ws->stats.write += secondsnow() - converted;
+        ws->stats.convert += converted - read;
+        ws->stats.readfinish += read - start;
+    }
+    
+    writing = false;
+    start = secondsnow();
+    png_read_end(readpng, NULL);
+    double read = secondsnow();
+    writing = true;
+    png_write_end(writepng, writeinfo);
+    if (fflush(output) != 0){
+        fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+        goto cleanup;
+    }
+    ws->stats.write += secondsnow() - read;
+    ws->stats.readfinish += read - start;
+    result = STREAM_DONE;
+    
+cleanup:
+    if (writepng != NULL){
+        png_structp png = writepng;
+        png_infop info = writeinfo;
+        png_destroy_write_struct(&png, (info != NULL) ? &info : NULL);
+    }
+    if (readpng != NULL){
+        png_structp png = readpng;
+        png_infop info = readinfo;
+        png_destroy_read_struct(&png, (info != NULL) ? &info : NULL, NULL);
+    }
+    free(rowpointers);
+    if (input != NULL){
+        fclose(input);
+    }
+    if (output != NULL){
+        if ((fclose(output) != 0) && (result == STREAM_DONE)){
+            fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+            result = STREAM_FAILED;
+        }
+        // don't leave half a png lying around
+        if (result != STREAM_DONE){
+            remove(outputfile);
+        }
+    }
+    return result;
+}
+
+// --16bit: read the whole png as 16-bit RGBA, convert it, and write it as 16-bit RGBA. Returns true on success.
+// Uses the full libpng API, since the simplified API's 16-bit formats are linear with premultiplied alpha.
+// Instead, an sRGB (or untagged) file is read as sRGB samples, and a file tagged as linear (gAMA 1.0) is read as linear,
+// which skips the sRGB decode entirely. 8 bit and smaller input is just widened. Either way the output is sRGB.
+bool convertsixteenbitfile(const char* inputfile, const char* outputfile, int mode, workspace* ws){
+    
+    // everything touched after setjmp has to be volatile
+    FILE* volatile input = NULL;
+    png_structp volatile png = NULL;
+    png_infop volatile info = NULL;
+    png_bytep* volatile rowpointers = NULL;
+    volatile bool result = false;
+    
+    pngerror error;
+    if (setjmp(error.jump)){
+        fprintf(stderr, "ntscjpng: read %s: %s\n", inputfile, error.message);
+        result = false;
+        goto cleanup;
+    }
+    
+    input = fopen(inputfile, "rb");
+    if (input == NULL){
+        fprintf(stderr, "ntscjpng: %s: %s\n", inputfile, strerror(errno));
+        goto cleanup;
+    }
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &error, pngerrorhandler, pngwarninghandler);
+    if (png != NULL){
+        info = png_create_info_struct(png);
+    }
+    if (info == NULL){
+        fprintf(stderr, "ntscjpng: out of memory reading %s\n", inputfile);
+        goto cleanup;
+    }
+    png_init_io(png, input);
+    double start = secondsnow();
+    png_read_info(png, info);
+    
+    // an sRGB chunk overrides gAMA, as far as libpng is concerned
+    png_fixed_point gamma = 0;
+    bool linear = !png_get_valid(png, info, PNG_INFO_sRGB) && png_get_gAMA_fixed(png, info, &gamma) && (gamma == PNG_GAMMA_LINEAR);
+    
+    // whatever we've got, turn it into 16-bit RGBA, in the machine's byte order
+    png_set_expand(png);
+    png_set_expand_16(png);
+    png_set_gray_to_rgb(png);
+    png_set_add_alpha(png, 0xffff, PNG_FILLER_AFTER);
+    png_set_alpha_mode(png, PNG_ALPHA_PNG, linear ? PNG_GAMMA_LINEAR : PNG_DEFAULT_sRGB);
+    if (littleendian()){
+        png_set_swap(png);
+    }
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    ws->stats.readbegin = secondsnow() - start;
+    
+    int width = (int)png_get_image_width(png, info);
+    int height = (int)png_get_image_height(png, info);
+    ws->stats.width = width;
+    ws->stats.height = height;
+    if (!checkmasksize(ws, inputfile, width, height)) goto cleanup;
+    
+    size_t rowbytes = (size_t)width * 8;
+    if (!reserveworkspace(ws, rowbytes * height)){
+        fprintf(stderr, "ntscjpng: out of memory: %lu bytes\n", (unsigned long)(rowbytes * height));
+        goto cleanup;
+    }
+    rowpointers = malloc(height * sizeof(png_bytep));
+    if (rowpointers == NULL){
+        fprintf(stderr, "ntscjpng: out of memory reading %s\n", inputfile);
+        goto cleanup;
+    }
+    for (int y=0; y<height; y++){
+        rowpointers[y] = &ws->buffer[rowbytes * y];
+    }
+    start = secondsnow();
+    png_read_image(png, rowpointers);
+    png_read_end(png, NULL);
+    ws->stats.readfinish = secondsnow() - start;
+    
+    start = secondsnow();
+    const runsettings* settings = ws->settings;
+    if (settings->mask != NULL){
+        ntscj_convert_masked16(ws->context, (uint16_t*)ws->buffer, rowbytes, settings->mask, width, width, height, 0, height,
+                               settings->rects, settings->rectcount, settings->tilesize, (ntscj_direction)mode, linear);
+    }
+    else if ((settings->rects != NULL) || (settings->tilesize > 0)){
+        ntscj_convert_rects16(ws->context, (uint16_t*)ws->buffer, rowbytes, width, height, 0, height, settings->rects, settings->rectcount, settings->tilesize, (ntscj_direction)mode, linear);
+    }
+    else {
+        ntscj_convert_rows16(ws->context, (uint16_t*)ws->buffer, rowbytes, width, height, 0, height, (ntscj_direction)mode, linear);
+    }
+    ws->stats.convert = secondsnow() - start;
+    
+    // writepngfile() reports its own errors
+    start = secondsnow();
+    result = writepngfile(outputfile, ws->buffer, width, height, PNG_COLOR_TYPE_RGB_ALPHA, 16, NULL, 0, &ws->settings->profile);
+    ws->stats.write = secondsnow() - start;
+    
+cleanup:
+    if (png != NULL){
+        png_structp p = png;
+        png_infop i = info;
+        png_destroy_read_struct(&p, (i != NULL) ? &i : NULL, NULL);
+    }
+    if (input != NULL){
+        fclose(input);
+    }
+    free(rowpointers);
+    return result;
+}
+
+// write a string as a JSON string literal
+void printjsonstring(FILE* file, const char* string){
+    fputc('"', file);
+    for (const unsigned char* c = (const unsigned char*)string; *c != '\0'; c++){
+        if ((*c == '"') || (*c == '\\')){
+            fprintf(file, "\\%c", *c);
+        }
+        else if (*c < 0x20){
+            fprintf(file, "\\u%04x", *c);
+        }
+        else {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// --stats output: one JSON object per line per file. Times are in milliseconds.
+void printstats(FILE* file, const char* inputfile, const char* outputfile, int mode, bool ok, const filestats* stats){
+    // hold the lock so lines from parallel workers don't get mixed together
+    flockfile(file);
+    fprintf(file, "{\"input\":");
+    printjsonstring(file, inputfile);
+    fprintf(file, ",\"output\":");
+    printjsonstring(file, outputfile);
+    fprintf(file, ",\"mode\":\"%s\",\"ok\":%s", (mode == 1) ? "ntscj-to-srgb" : "srgb-to-ntscj", ok ? "true" : "false");
+    fprintf(file, ",\"width\":%i,\"height\":%i,\"pixels\":%lld", stats->width, stats->height, (long long)stats->width * stats->height);
+    fprintf(file, ",\"read_begin_ms\":%.3f,\"read_finish_ms\":%.3f,\"convert_ms\":%.3f,\"write_ms\":%.3f", stats->readbegin * 1000.0, stats->readfinish * 1000.0, stats->convert * 1000.0, stats->write * 1000.0);
+    if (stats->frames > 0){
+        fprintf(file, ",\"frames\":%lld", stats->frames);
+    }
+    fprintf(file, ",\"clipped_low\":%lld,\"clipped_high\":%lld,\"cached\":%s}\n", stats->clips.low, stats->clips.high, stats->cached ? "true" : "false");
+    funlockfile(file);
+}
+
+// Convert headerless 8-bit RGBA of the size given in the run settings, with no png codec at all, so we can be a filter in a pipe.
+// "-" means stdin or stdout. Goes a strip at a time when streaming, otherwise reads the whole image first.
+bool convertrawfile(const char* inputfile, const char* outputfile, int mode, workspace* ws){
+    int width = ws->settings->rawwidth;
+    int height = ws->settings->rawheight;
+    ws->stats.width = width;
+    ws->stats.height = height;
+    if (!checkmasksize(ws, inputfile, width, height)) return false;
+    bool fromstdin = (strcmp(inputfile, "-") == 0);
+    bool tostdout = (strcmp(outputfile, "-") == 0);
+    
+    FILE* input = fromstdin ? stdin : fopen(inputfile, "rb");
+    if (input == NULL){
+        fprintf(stderr, "ntscjpng: %s: %s\n", inputfile, strerror(errno));
+        return false;
+    }
+    FILE* output = tostdout ? stdout : fopen(outputfile, "wb");
+    if (output == NULL){
+        fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+        if (!fromstdin) fclose(input);
+        return false;
+    }
+    
+    bool result = false;
+    int striprows = ws->settings->stream ? (ws->threads * STREAM_ROWS_PER_THREAD) : height;
+    if (striprows > height) striprows = height;
+    size_t rowbytes = (size_t)width * 4;
+    if (reserveworkspace(ws, rowbytes * striprows)){
+        result = true;
+        for (int y=0; (y<height) && result; y+=striprows){
+            int rows = (height - y < striprows) ? (height - y) : striprows;
+            double start = secondsnow();
+            size_t bytes = rowbytes * rows;
+            if (fread(ws->buffer, 1, bytes, input) != bytes){
+                fprintf(stderr, "ntscjpng: read %s: %s\n", inputfile, ferror(input) ? strerror(errno) : "file is smaller than the given size");
+                result = false;
+                break;
+            }
+            double read = secondsnow();
+            convertstrip(ws->buffer, width, height, y, rows, 4, mode, ws);
+            double converted = secondsnow();
+            if (fwrite(ws->buffer, 1, bytes, output) != bytes){
+                fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+                result = false;
+            }
+            ws->stats.readfinish += read - start;
+            ws->stats.convert += converted - read;
+            ws->stats.write += secondsnow() - converted;
+        }
+    }
+    else {
+        fprintf(stderr, "ntscjpng: out of memory: %lu bytes\n", (unsigned long)(rowbytes * striprows));
+    }
+    
+    if (!fromstdin){
+        fclose(input);
+    }
+    if (tostdout){
+        if ((fflush(output) != 0) && result){
+            fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+            result = false;
+        }
+    }
+    else if ((fclose(output) != 0) && result){
+        fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+        result = false;
+    }
+    return result;
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+// Video
+// A stream of raw RGBA8 frames, all the size given in the run settings, e.g. from ffmpeg -f rawvideo -pix_fmt rgba, converted one after another
+// until the input runs out. One thread reads frames, one writes them, and the workspace's threads convert them, so all three overlap.
+// Every frame gets the same dither pattern, so still parts of the picture stay still.
+
+// frame buffers in flight: one being read, one being converted, one being written, and one spare so a slow stage doesn't stall the others
+#define VIDEO_FRAMES 4
+
+typedef struct videopipe {
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // signaled whenever any of the counts or flags below change
+    png_bytep frames[VIDEO_FRAMES]; // frame n is in frames[n % VIDEO_FRAMES]
+    size_t framebytes;
+    long long read; // frames read so far
+    long long converted;
+    long long written;
+    bool readdone; // no more frames are coming
+    bool convertdone;
+    bool failed; // something went wrong, so everyone stops
+    bool truncated; // the input ended partway through a frame; the frames before it still go out
+    FILE* input;
+    FILE* output;
+    const char* inputfile;
+    const char* outputfile;
+    double readtime; // seconds spent reading and writing, for --stats
+    double writetime;
+} videopipe;
+
+void* videoreaderthread(void* arg){
+    videopipe* pipe = arg;
+    pthread_mutex_lock(&pipe->lock);
+    while (!pipe->failed){
+        // wait for the writer to free a buffer
+        while (!pipe->failed && (pipe->read - pipe->written >= VIDEO_FRAMES)){
+            pthread_cond_wait(&pipe->changed, &pipe->lock);
+        }
+        if (pipe->failed) break;
+        png_bytep frame = pipe->frames[pipe->read % VIDEO_FRAMES];
+        pthread_mutex_unlock(&pipe->lock);
+        double start = secondsnow();
+        size_t bytes = fread(frame, 1, pipe->framebytes, pipe->input);
+        double elapsed = secondsnow() - start;
+        pthread_mutex_lock(&pipe->lock);
+        pipe->readtime += elapsed;
+        if (bytes == pipe->framebytes){
+            pipe->read++;
+        }
+        else {
+            // the end of the input has to fall between frames
+            if (ferror(pipe->input)){
+                fprintf(stderr, "ntscjpng: read %s: %s\n", pipe->inputfile, strerror(errno));
+                pipe->failed = true;
+            }
+            else if (bytes > 0){
+                fprintf(stderr, "ntscjpng: read %s: input ends partway through a frame\n", pipe->inputfile);
+                pipe->truncated = true;
+            }
+            break;
+        }
+        pthread_cond_broadcast(&pipe->changed);
+    }
+    pipe->readdone = true;
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+void* videowriterthread(void* arg){
+    videopipe* pipe = arg;
+    pthread_mutex_lock(&pipe->lock);
+    while (!pipe->failed){
+        while (!pipe->failed && (pipe->written == pipe->converted) && !pipe->convertdone){
+            pthread_cond_wait(&pipe->changed, &pipe->lock);
+        }
+        if (pipe->failed || (pipe->written == pipe->converted)) break;
+        png_bytep frame = pipe->frames[pipe->written % VIDEO_FRAMES];
+        pthread_mutex_unlock(&pipe->lock);
+        double start = secondsnow();
+        // flush each frame, so whatever's reading the output gets it right away instead of when the stdio buffer fills
+        bool ok = (fwrite(frame, 1, pipe->framebytes, pipe->output) == pipe->framebytes) && (fflush(pipe->output) == 0);
+        double elapsed = secondsnow() - start;
+        pthread_mutex_lock(&pipe->lock);
+        pipe->writetime += elapsed;
+        if (!ok){
+            fprintf(stderr, "ntscjpng: write %s: %s\n", pipe->outputfile, strerror(errno));
+            pipe->failed = true;
+            break;
+        }
+        pipe->written++;
+        pthread_cond_broadcast(&pipe->changed);
+    }
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+// Convert frames on this thread (and the workspace's threads) as the reader hands them over, until it runs out.
+void videoconverter(videopipe* pipe, int width, int height, int mode, workspace* ws){
+    pthread_mutex_lock(&pipe->lock);
+    while (!pipe->failed){
+        while (!pipe->failed && (pipe->converted == pipe->read) && !pipe->readdone){
+            pthread_cond_wait(&pipe->changed, &pipe->lock);
+        }
+        if (pipe->failed || (pipe->converted == pipe->read)) break;
+        png_bytep frame = pipe->frames[pipe->converted % VIDEO_FRAMES];
+        pthread_mutex_unlock(&pipe->lock);
+        double start = secondsnow();
+        convertimage(frame, width, height, 4, mode, ws);
+        ws->stats.convert += secondsnow() - start;
+        pthread_mutex_lock(&pipe->lock);
+        pipe->converted++;
+        pthread_cond_broadcast(&pipe->changed);
+    }
+    pipe->convertdone = true;
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+bool convertvideofile(const char* inputfile, const char* outputfile, int mode, workspace* ws){
+    int width = ws->settings->rawwidth;
+    int height = ws->settings->rawheight;
+    ws->stats.width = width;
+    ws->stats.height = height;
+    if (!checkmasksize(ws, inputfile, width, height)) return false;
+    bool fromstdin = (strcmp(inputfile, "-") == 0);
+    bool tostdout = (strcmp(outputfile, "-") == 0);
+    
+    videopipe pipe;
+    memset(&pipe, 0, sizeof pipe);
+    pipe.framebytes = (size_t)width * height * 4;
+    pipe.inputfile = inputfile;
+    pipe.outputfile = outputfile;
+    // the frame buffers live in the workspace buffer, so they're reused from one file to the next
+    if (!reserveworkspace(ws, pipe.framebytes * VIDEO_FRAMES)){
+        fprintf(stderr, "ntscjpng: out of memory: %lu bytes\n", (unsigned long)(pipe.framebytes * VIDEO_FRAMES));
+        return false;
+    }
+    for (int i=0; i<VIDEO_FRAMES; i++){
+        pipe.frames[i] = ws->buffer + (pipe.framebytes * i);
+    }
+    
+    pipe.input = fromstdin ? stdin : fopen(inputfile, "rb");
+    if (pipe.input == NULL){
+        fprintf(stderr, "ntscjpng: %s: %s\n", inputfile, strerror(errno));
+        return false;
+    }
+    pipe.output = tostdout ? stdout : fopen(outputfile, "wb");
+    if (pipe.output == NULL){
+        fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+        if (!fromstdin) fclose(pipe.input);
+        return false;
+    }
+    
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.changed, NULL);
+    pthread_t reader;
+    pthread_t writer;
+    bool result = false;
+    if (pthread_create(&reader, NULL, videoreaderthread, &pipe) == 0){
+        if (pthread_create(&writer, NULL, videowriterthread, &pipe) == 0){
+            videoconverter(&pipe, width, height, mode, ws);
+            pthread_join(writer, NULL);
+            result = !pipe.failed && !pipe.truncated;
+        }
+        else {
+            fprintf(stderr, "ntscjpng: cannot start a thread\n");
+            pthread_mutex_lock(&pipe.lock);
+            pipe.failed = true;
+            pthread_cond_broadcast(&pipe.changed);
+            pthread_mutex_unlock(&pipe.lock);
+        }
+        pthread_join(reader, NULL);
+    }
+    else {
+        fprintf(stderr, "ntscjpng: cannot start a thread\n");
+    }
+    pthread_cond_destroy(&pipe.changed);
+    pthread_mutex_destroy(&pipe.lock);
+    ws->stats.frames = pipe.written;
+    ws->stats.readfinish = pipe.readtime;
+    ws->stats.write = pipe.writetime;
+    
+    if (!fromstdin){
+        fclose(pipe.input);
+    }
+    if (!tostdout && (fclose(pipe.output) != 0) && result){
+        fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+        result = false;
+    }
+    return result;
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+// Analysis
+// --analyze decodes each png and runs the conversion over it with every option as given, a strip at a time into a scratch buffer,
+// comparing each strip with what it was, but never encodes or writes anything. Encoding is most of the time a conversion takes,
+// so this scans a whole texture set a few times faster, to find the files that actually need reconverting.
+
+// rows per strip for each conversion thread when analyzing
+#define ANALYZE_ROWS_PER_THREAD 64
+
+// Fills in the size, timings, changed pixel count, and largest delta in ws->stats. Returns true on success.
+bool analyzefile(const char* inputfile, int mode, workspace* ws){
+    png_image image;
+    memset(&image, 0, sizeof image);
+    image.version = PNG_IMAGE_VERSION;
+    
+    double start = secondsnow();
+    mappedfile mapped;
+    bool usemap = mapfile(inputfile, &mapped);
+    if (!(usemap ? png_image_begin_read_from_memory(&image, mapped.data, mapped.size) : png_image_begin_read_from_file(&image, inputfile))){
+        fprintf(stderr, "ntscjpng: %s: %s\n", inputfile, image.message);
+        if (usemap) unmapfile(&mapped);
+        return false;
+    }
+    ws->stats.readbegin = secondsnow() - start;
+    ws->stats.width = image.width;
+    ws->stats.height = image.height;
+    image.format = readformat(&image, ws->settings);
+    int channels = PNG_IMAGE_PIXEL_CHANNELS(image.format);
+    int width = (int)image.width;
+    int height = (int)image.height;
+    size_t rowbytes = (size_t)width * channels;
+    int striprows = ws->threads * ANALYZE_ROWS_PER_THREAD;
+    if (striprows > height) striprows = height;
+    
+    bool result = false;
+    if (!checkmasksize(ws, inputfile, width, height)){
+        png_image_free(&image);
+    }
+    else if (!reserveworkspace(ws, PNG_IMAGE_SIZE(image))){
+        fprintf(stderr, "ntscjpng: out of memory: %lu bytes\n", (unsigned long)PNG_IMAGE_SIZE(image));
+        png_image_free(&image);
+    }
+    else {
+        // there's no png to encode, so the strips are converted in the encode buffer
+        if (ws->encodedsize < rowbytes * striprows){
+            png_bytep newbuffer = realloc(ws->encoded, rowbytes * striprows);
+            if (newbuffer != NULL){
+                ws->encoded = newbuffer;
+                ws->encodedsize = rowbytes * striprows;
+            }
+        }
+        start = secondsnow();
+        if (ws->encodedsize < rowbytes * striprows){
+            fprintf(stderr, "ntscjpng: out of memory: %lu bytes\n", (unsigned long)(rowbytes * striprows));
+            png_image_free(&image);
+        }
+        else if (!png_image_finish_read(&image, NULL/*background*/, ws->buffer, 0/*row_stride*/, NULL)){
+            fprintf(stderr, "ntscjpng: read %s: %s\n", inputfile, image.message);
+        }
+        else {
+            ws->stats.readfinish = secondsnow() - start;
+            start = secondsnow();
+            for (int y=0; y<height; y+=striprows){
+                int rows = (height - y < striprows) ? (height - y) : striprows;
+                const png_byte* original = &ws->buffer[rowbytes * y];
+                memcpy(ws->encoded, original, rowbytes * rows);
+                convertstrip(ws->encoded, width, height, y, rows, channels, mode, ws);
+                size_t pixels = (size_t)width * rows;
+                for (size_t i=0; i<pixels; i++){
+                    const png_byte* before = &original[i * channels];
+                    const png_byte* after = &ws->encoded[i * channels];
+                    int delta = 0;
+                    for (int c=0; c<3; c++){
+                        int difference = abs((int)after[c] - (int)before[c]);
+                        if (difference > delta) delta = difference;
                     }
+                    if (delta == 0) continue;
+                    ws->stats.changed++;
+                    if (delta > ws->stats.maxdelta) ws->stats.maxdelta = delta;
                 }
-                
-                // End actual color conversion code
-                // ------------------------------------------------------------------------------------------------------------------------------------------
-                
-                
-               if (png_image_write_to_file(&image, argv[3], 0/*convert_to_8bit*/, buffer, 0/*row_stride*/, NULL/*colormap*/)){
-                  result = 0;
-                  printf("done.\n");
-               }
+            }
+            ws->stats.convert = secondsnow() - start;
+            result = true;
+        }
+    }
+    if (usemap){
+        unmapfile(&mapped);
+    }
+    return result;
+}
 
-               else {
-                  fprintf(stderr, "ntscjpng: write %s: %s\n", argv[3], image.message);
-               }
+// --analyze output: one JSON object per line per file. Times are in milliseconds.
+void printanalysis(FILE* file, const char* inputfile, int mode, bool ok, const filestats* stats){
+    flockfile(file);
+    fprintf(file, "{\"input\":");
+    printjsonstring(file, inputfile);
+    fprintf(file, ",\"mode\":\"%s\",\"ok\":%s", (mode == 1) ? "ntscj-to-srgb" : "srgb-to-ntscj", ok ? "true" : "false");
+    fprintf(file, ",\"width\":%i,\"height\":%i,\"pixels\":%lld", stats->width, stats->height, (long long)stats->width * stats->height);
+    fprintf(file, ",\"changed_pixels\":%lld,\"max_delta\":%i,\"identical\":%s", stats->changed, stats->maxdelta, (ok && (stats->changed == 0)) ? "true" : "false");
+    fprintf(file, ",\"clipped_low\":%lld,\"clipped_high\":%lld", stats->clips.low, stats->clips.high);
+    fprintf(file, ",\"read_ms\":%.3f,\"convert_ms\":%.3f}\n", (stats->readbegin + stats->readfinish) * 1000.0, stats->convert * 1000.0);
+    funlockfile(file);
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+// Result cache
+// Cache entries are named for a 64-bit FNV-1a hash of the input file's bytes, the mode, and cacheseed,
+// which covers the version and every option that changes the output. Anything that only changes speed
+// (--threads, --memo, --no-simd, --jobs, --tile) is left out, so those can change without invalidating the cache.
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+unsigned long long fnv1a(unsigned long long hash, const void* data, size_t size){
+    const unsigned char* bytes = data;
+    for (size_t i=0; i<size; i++){
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// Hash of the settings that affect the output bytes, for runsettings.cacheseed.
+unsigned long long makecacheseed(const ntscj_options* options, const runsettings* settings){
+    char description[256];
+    const pngprofile* profile = &settings->profile;
+    snprintf(description, sizeof description, "ntscjpng %s libpng %s exact=%i fixed=%i skiptransparent=%i palette=%i png=%i,%i,%i,%i raw=%ix%i video=%i stream=%i 16bit=%i rgba=%i decode=%i encode=%i",
+             NTSCJ_VERSION, PNG_LIBPNG_VER_STRING, options->exact ? 1 : 0, (options->fixed || options->gpu) ? 1 : 0, options->skiptransparent ? 1 : 0, settings->palette ? 1 : 0,
+             profile->custom ? 1 : 0, profile->level, profile->strategy, profile->filters,
+             settings->rawwidth, settings->rawheight, settings->video ? 1 : 0, settings->stream ? 1 : 0, settings->sixteenbit ? 1 : 0, settings->rgba ? 1 : 0,
+             (int)options->decode, (int)options->encode);
+    unsigned long long hash = fnv1a(FNV_OFFSET_BASIS, description, strlen(description));
+    if (settings->rects != NULL){
+        hash = fnv1a(hash, settings->rects, (size_t)settings->rectcount * sizeof(ntscj_rect));
+    }
+    if (settings->mask != NULL){
+        hash = fnv1a(hash, &settings->maskwidth, sizeof settings->maskwidth);
+        hash = fnv1a(hash, &settings->maskheight, sizeof settings->maskheight);
+        hash = fnv1a(hash, settings->mask, (size_t)settings->maskwidth * settings->maskheight);
+    }
+    // the default profile's matrices would come out a little different if worked out from its gamut, so anything else counts
+    if ((options->profile != NULL) && (options->profile != ntscj_find_profile("ntscj"))){
+        hash = fnv1a(hash, ntscj_profile_gamut(options->profile), sizeof(ntscj_gamut));
+    }
+    if (options->lut != NULL){
+        int size = ntscj_lut_size(options->lut);
+        hash = fnv1a(hash, &size, sizeof size);
+        hash = fnv1a(hash, ntscj_lut_values(options->lut), (size_t)size * size * size * 3 * sizeof(float));
+        hash = fnv1a(hash, options->trilinear ? "trilinear" : "tetrahedral", options->trilinear ? 9 : 11);
+    }
+    return hash;
+}
+
+// Work out the cache entry name for an input file. Returns false if the file can't be read, in which case
+// the conversion will fail on its own with a proper message.
+bool cachepath(const char* inputfile, int mode, const runsettings* settings, char* path, size_t pathsize){
+    FILE* input = fopen(inputfile, "rb");
+    if (input == NULL) return false;
+    unsigned char mode8 = (unsigned char)mode;
+    unsigned long long hash = fnv1a(settings->cacheseed, &mode8, 1);
+    unsigned char chunk[16384];
+    size_t bytes;
+    while ((bytes = fread(chunk, 1, sizeof chunk, input)) > 0){
+        hash = fnv1a(hash, chunk, bytes);
+    }
+    bool ok = !ferror(input);
+    fclose(input);
+    snprintf(path, pathsize, "%s/%016llx.%s", settings->cachedir, hash, (settings->rawwidth > 0) ? "raw" : "png");
+    return ok;
+}
+
+// Copy a file, replacing the destination. Returns false with errno set on failure.
+bool copyfile(const char* from, const char* to){
+    FILE* input = fopen(from, "rb");
+    if (input == NULL) return false;
+    FILE* output = fopen(to, "wb");
+    if (output == NULL){
+        int error = errno;
+        fclose(input);
+        errno = error;
+        return false;
+    }
+    unsigned char chunk[16384];
+    size_t bytes;
+    bool ok = true;
+    while (ok && ((bytes = fread(chunk, 1, sizeof chunk, input)) > 0)){
+        ok = (fwrite(chunk, 1, bytes, output) == bytes);
+    }
+    int error = errno;
+    if (ferror(input)) ok = false;
+    fclose(input);
+    if (fclose(output) != 0) ok = false;
+    else errno = error;
+    return ok;
+}
+
+// Put a cache hit in place of the output. Returns false if the entry doesn't exist or can't be copied.
+bool fetchcached(const char* entry, const char* outputfile, const runsettings* settings){
+    if (access(entry, R_OK) != 0) return false;
+    // always unlink first: if the old output is a hard link into the cache, writing over it would change the cache entry too
+    unlink(outputfile);
+    if (settings->cachelink && (link(entry, outputfile) == 0)) return true;
+    return copyfile(entry, outputfile);
+}
+
+// Add a freshly converted output to the cache. Goes via a temporary file and rename(), so that other runs
+// (or other --jobs workers) never see a half written entry. Failure here only costs a future cache miss.
+void storecached(const char* entry, const char* outputfile, const runsettings* settings, const workspace* ws){
+    char temporary[4096 + 64];
+    snprintf(temporary, sizeof temporary, "%s.%ld.%p.tmp", entry, (long)getpid(), (const void*)ws);
+    bool ok = (settings->cachelink && (link(outputfile, temporary) == 0)) || copyfile(outputfile, temporary);
+    if (!ok || (rename(temporary, entry) != 0)){
+        fprintf(stderr, "ntscjpng: cannot add %s to cache: %s\n", outputfile, strerror(errno));
+        unlink(temporary);
+    }
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+
+// Read, convert, and write one png (or raw) file. Returns true on success.
+bool convertfile(const char* inputfile, const char* outputfile, int mode, workspace* ws){
+   
+   // with --analyze there's no output file, and the report is the output
+   if (ws->settings->analyze){
+      memset(&ws->stats, 0, sizeof ws->stats);
+      ntscj_reset_clip_counts(ws->context);
+      bool result = analyzefile(inputfile, mode, ws);
+      ws->stats.clips = ntscj_get_clip_counts(ws->context);
+      printanalysis(stdout, inputfile, mode, result, &ws->stats);
+      return result;
+   }
+   
+   const char* description = (mode == 1) ? "from NTSC-J color gamut to sRGB color gamut" : "from sRGB color gamut to NTSC-J color gamut";
+   // if the image itself is going to stdout, messages have to go somewhere else
+   FILE* messages = (strcmp(outputfile, "-") == 0) ? stderr : stdout;
+   // when other files are being converted at the same time, wait and print the whole message at once so the lines don't get jumbled
+   if (!ws->parallel && !ws->settings->printstats){
+      fprintf(messages, "ntscjpng: converting %s %s and saving output to %s... ", inputfile, description, outputfile);
+      // make sure the progress message comes out before any error message
+      fflush(messages);
+   }
+   
+   memset(&ws->stats, 0, sizeof ws->stats);
+   ntscj_reset_clip_counts(ws->context);
+   
+   // the cache only works on real files
+   char entry[4096];
+   bool usecache = (ws->settings->cachedir != NULL) && (strcmp(inputfile, "-") != 0) && (strcmp(outputfile, "-") != 0)
+                   && cachepath(inputfile, mode, ws->settings, entry, sizeof entry);
+   
+   bool result;
+   if (usecache && fetchcached(entry, outputfile, ws->settings)){
+      result = true;
+      ws->stats.cached = true;
+   }
+   else if (ws->settings->video){
+      result = convertvideofile(inputfile, outputfile, mode, ws);
+   }
+   else if (ws->settings->rawwidth > 0){
+      result = convertrawfile(inputfile, outputfile, mode, ws);
+   }
+   else if (ws->settings->sixteenbit){
+      result = convertsixteenbitfile(inputfile, outputfile, mode, ws);
+   }
+   else {
+      int streamed = ws->settings->stream ? convertstreamingfile(inputfile, outputfile, mode, ws) : STREAM_UNSUPPORTED;
+      if (streamed == STREAM_UNSUPPORTED){
+         result = convertwholefile(inputfile, outputfile, mode, ws);
+      }
+      else {
+         result = (streamed == STREAM_DONE);
+      }
+   }
+   if (result && usecache && !ws->stats.cached){
+      storecached(entry, outputfile, ws->settings, ws);
+   }
+   
+   ws->stats.clips = ntscj_get_clip_counts(ws->context);
+   
+   if (ws->settings->printstats){
+      printstats(messages, inputfile, outputfile, mode, result, &ws->stats);
+   }
+   else if (result){
+      const char* done = ws->stats.cached ? "done (cached)." : "done.";
+      if (ws->parallel){
+         fprintf(messages, "ntscjpng: converting %s %s and saving output to %s... %s\n", inputfile, description, outputfile, done);
+      }
+      else {
+         fprintf(messages, "%s\n", done);
+      }
+   }
+   
+   return result;
+}
+
+// One file to convert.
+typedef struct filejob {
+    char* inputfile;
+    char* outputfile;
+    off_t size; // input file size, for scheduling
+} filejob;
+
+// All the files to convert in this run.
+typedef struct joblist {
+    filejob* jobs;
+    size_t count;
+    size_t capacity;
+} joblist;
+
+void initjoblist(joblist* list){
+    list->jobs = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+void freejoblist(joblist* list){
+    for (size_t i=0; i<list->count; i++){
+        free(list->jobs[i].inputfile);
+        free(list->jobs[i].outputfile);
+    }
+    free(list->jobs);
+    initjoblist(list);
+}
+
+// outputfile may be NULL with --analyze.
+bool addjob(joblist* list, const char* inputfile, const char* outputfile){
+    if (list->count == list->capacity){
+        size_t newcapacity = (list->capacity == 0) ? 64 : list->capacity * 2;
+        filejob* newjobs = realloc(list->jobs, newcapacity * sizeof(filejob));
+        if (newjobs == NULL) return false;
+        list->jobs = newjobs;
+        list->capacity = newcapacity;
+    }
+    filejob* job = &list->jobs[list->count];
+    job->inputfile = strdup(inputfile);
+    job->outputfile = (outputfile != NULL) ? strdup(outputfile) : NULL;
+    if ((job->inputfile == NULL) || ((outputfile != NULL) && (job->outputfile == NULL))){
+        free(job->inputfile);
+        free(job->outputfile);
+        return false;
+    }
+    // if we can't stat it, convertfile() will report the problem later
+    struct stat info;
+    job->size = (stat(inputfile, &info) == 0) ? info.st_size : 0;
+    list->count++;
+    return true;
+}
+
+// Read every input/output pair listed in a batch file, one pair per line, separated by a tab.
+// Blank lines are skipped. Returns the number of bad lines.
+int readbatchlist(FILE* file, const char* listname, joblist* list){
+   int failures = 0;
+   char line[2 * 4096];
+   int linenumber = 0;
+   while (fgets(line, sizeof line, file) != NULL){
+      linenumber++;
+      size_t length = strlen(line);
+      while ((length > 0) && ((line[length - 1] == '\n') || (line[length - 1] == '\r'))){
+         line[--length] = '\0';
+      }
+      if (length == 0) continue;
+      char* tab = strchr(line, '\t');
+      if ((tab == NULL) || (tab == line) || (tab[1] == '\0')){
+         fprintf(stderr, "ntscjpng: %s:%i: expected \"input<tab>output\"\n", listname, linenumber);
+         failures++;
+         continue;
+      }
+      *tab = '\0';
+      if (!addjob(list, line, tab + 1)){
+         fprintf(stderr, "ntscjpng: out of memory reading %s\n", listname);
+         failures++;
+      }
+   }
+   return failures;
+}
+
+bool haspngextension(const char* name){
+    size_t length = strlen(name);
+    return (length > 4) && (strcasecmp(name + length - 4, ".png") == 0);
+}
+
+// Add every .png file under inputdir to the list, to be written to the same relative path under outputdir.
+// Creates the output directories as it goes, unless outputdir is NULL, for --analyze. Returns the number of failures.
+int readdirectorytree(const char* inputdir, const char* outputdir, joblist* list){
+    if ((outputdir != NULL) && (mkdir(outputdir, 0777) != 0) && (errno != EEXIST)){
+        fprintf(stderr, "ntscjpng: cannot create directory %s: %s\n", outputdir, strerror(errno));
+        return 1;
+    }
+    DIR* dir = opendir(inputdir);
+    if (dir == NULL){
+        fprintf(stderr, "ntscjpng: cannot open directory %s: %s\n", inputdir, strerror(errno));
+        return 1;
+    }
+    int failures = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL){
+        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) continue;
+        size_t inputlength = strlen(inputdir) + strlen(entry->d_name) + 2;
+        size_t outputlength = (outputdir != NULL) ? (strlen(outputdir) + strlen(entry->d_name) + 2) : 0;
+        char* inputpath = malloc(inputlength);
+        char* outputpath = (outputdir != NULL) ? malloc(outputlength) : NULL;
+        if ((inputpath == NULL) || ((outputdir != NULL) && (outputpath == NULL))){
+            free(inputpath);
+            free(outputpath);
+            fprintf(stderr, "ntscjpng: out of memory reading %s\n", inputdir);
+            failures++;
+            break;
+        }
+        snprintf(inputpath, inputlength, "%s/%s", inputdir, entry->d_name);
+        if (outputpath != NULL) snprintf(outputpath, outputlength, "%s/%s", outputdir, entry->d_name);
+        struct stat info;
+        if (stat(inputpath, &info) == 0){
+            if (S_ISDIR(info.st_mode)){
+                failures += readdirectorytree(inputpath, outputpath, list);
             }
+            else if (S_ISREG(info.st_mode) && haspngextension(entry->d_name)){
+                if (!addjob(list, inputpath, outputpath)){
+                    fprintf(stderr, "ntscjpng: out of memory reading %s\n", inputdir);
+                    failures++;
+                }
+            }
+        }
+        free(inputpath);
+        free(outputpath);
+    }
+    closedir(dir);
+    return failures;
+}
+
+// biggest first
+int comparejobsize(const void* a, const void* b){
+    off_t sizea = ((const filejob*)a)->size;
+    off_t sizeb = ((const filejob*)b)->size;
+    if (sizea > sizeb) return -1;
+    if (sizea < sizeb) return 1;
+    return 0;
+}
+
+// The work queue shared by all the file workers.
+typedef struct jobqueue {
+    joblist* list;
+    size_t next;
+    int failures;
+    int mode;
+    pthread_mutex_t lock;
+} jobqueue;
+
+// One file worker, with its own buffers and memos.
+typedef struct fileworker {
+    jobqueue* queue;
+    workspace ws;
+} fileworker;
 
+void* fileworkerthread(void* arg){
+    fileworker* worker = arg;
+    jobqueue* queue = worker->queue;
+    while (true){
+        pthread_mutex_lock(&queue->lock);
+        size_t index = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (index >= queue->list->count) break;
+        filejob* job = &queue->list->jobs[index];
+        if (!convertfile(job->inputfile, job->outputfile, queue->mode, &worker->ws)){
+            pthread_mutex_lock(&queue->lock);
+            queue->failures++;
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+    return NULL;
+}
+
+// Convert everything in the list using a pool of file workers.
+// The biggest files go first, so that a big background doesn't end up running alone after all the little sprites are done.
+// Returns the number of failures.
+int convertjobs(joblist* list, int mode, int jobs, const ntscj_options* options, const runsettings* settings){
+    if (jobs > (int)list->count) jobs = (int)list->count;
+    if (jobs < 1) jobs = 1;
+    
+    if (jobs > 1){
+        qsort(list->jobs, list->count, sizeof(filejob), comparejobsize);
+    }
+    
+    jobqueue queue;
+    queue.list = list;
+    queue.next = 0;
+    queue.failures = 0;
+    queue.mode = mode;
+    pthread_mutex_init(&queue.lock, NULL);
+    
+    fileworker* workers = malloc(jobs * sizeof(fileworker));
+    pthread_t* workerthreads = malloc(jobs * sizeof(pthread_t));
+    bool* started = malloc(jobs * sizeof(bool));
+    if ((workers == NULL) || (workerthreads == NULL) || (started == NULL)){
+        fprintf(stderr, "ntscjpng: out of memory starting file workers\n");
+        free(workers);
+        free(workerthreads);
+        free(started);
+        pthread_mutex_destroy(&queue.lock);
+        return (int)list->count;
+    }
+    
+    int ready = 0;
+    for (int i=0; i<jobs; i++){
+        workers[i].queue = &queue;
+        // no workspace means no more workers
+        if (!initworkspace(&workers[i].ws, options)) break;
+        workers[i].ws.parallel = (jobs > 1);
+        workers[i].ws.settings = settings;
+        ready++;
+    }
+    if (ready == 0){
+        fprintf(stderr, "ntscjpng: out of memory starting file workers\n");
+        free(workers);
+        free(workerthreads);
+        free(started);
+        pthread_mutex_destroy(&queue.lock);
+        return (int)list->count;
+    }
+    jobs = ready;
+    // this thread is worker 0
+    for (int i=1; i<jobs; i++){
+        started[i] = (pthread_create(&workerthreads[i], NULL, fileworkerthread, &workers[i]) == 0);
+    }
+    fileworkerthread(&workers[0]);
+    for (int i=1; i<jobs; i++){
+        if (started[i]){
+            pthread_join(workerthreads[i], NULL);
+        }
+    }
+    
+    for (int i=0; i<jobs; i++){
+        freeworkspace(&workers[i].ws);
+    }
+    free(workers);
+    free(workerthreads);
+    free(started);
+    pthread_mutex_destroy(&queue.lock);
+    return queue.failures;
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+// Benchmark
+// Times png decode, color conversion, and png encode separately, all in memory, so a regression can be pinned on the gamut kernel or on libpng.
+
+int comparedouble(const void* a, const void* b){
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// One image to benchmark, held as an encoded png in memory.
+typedef struct benchmarkimage {
+    char name[64];
+    png_bytep png;
+    size_t pngsize;
+} benchmarkimage;
+
+// Encode an RGBA buffer into a new benchmarkimage. Returns false on failure.
+bool makebenchmarkimage(benchmarkimage* bi, const char* name, png_bytep pixels, int width, int height){
+    png_image image;
+    memset(&image, 0, sizeof image);
+    image.version = PNG_IMAGE_VERSION;
+    image.width = width;
+    image.height = height;
+    image.format = PNG_FORMAT_RGBA;
+    png_alloc_size_t size = PNG_IMAGE_PNG_SIZE_MAX(image);
+    snprintf(bi->name, sizeof bi->name, "%s %ix%i", name, width, height);
+    bi->png = malloc(size);
+    if (bi->png == NULL) return false;
+    if (!png_image_write_to_memory(&image, bi->png, &size, 0, pixels, 0, NULL)){
+        fprintf(stderr, "ntscjpng: bench: encoding %s: %s\n", bi->name, image.message);
+        free(bi->png);
+        bi->png = NULL;
+        return false;
+    }
+    bi->pngsize = size;
+    return true;
+}
+
+// synthetic workloads: 0 is a smooth gradient, 1 is random noise, 2 is every 24-bit color exactly once
+bool makesyntheticimage(benchmarkimage* bi, int kind){
+    int width = (kind == 2) ? 4096 : 1024;
+    int height = width;
+    png_bytep pixels = malloc((size_t)width * height * 4);
+    if (pixels == NULL) return false;
+    unsigned int seed = 12345;
+    for (int y=0; y<height; y++){
+        for (int x=0; x<width; x++){
+            png_byte* pixel = &pixels[(((size_t)y * width) + x) * 4];
+            if (kind == 0){
+                pixel[0] = (png_byte)((x * 255) / (width - 1));
+                pixel[1] = (png_byte)((y * 255) / (height - 1));
+                pixel[2] = (png_byte)(((x + y) * 255) / (width + height - 2));
+            }
+            else if (kind == 1){
+                seed = (seed * 1103515245u) + 12345u;
+                pixel[0] = (png_byte)(seed >> 24);
+                pixel[1] = (png_byte)(seed >> 16);
+                pixel[2] = (png_byte)(seed >> 8);
+            }
             else {
-               fprintf(stderr, "ntscjpng: read %s: %s\n", argv[2], image.message);
+                unsigned int color = ((unsigned int)y * width) + x;
+                pixel[0] = (png_byte)(color >> 16);
+                pixel[1] = (png_byte)(color >> 8);
+                pixel[2] = (png_byte)color;
             }
+            pixel[3] = 255;
+        }
+    }
+    const char* names[3] = {"gradient", "random", "all-colors"};
+    bool result = makebenchmarkimage(bi, names[kind], pixels, width, height);
+    free(pixels);
+    return result;
+}
 
-            free(buffer);
-            buffer = NULL;
-         }
+bool loadbenchmarkimage(benchmarkimage* bi, const char* filename){
+    bi->png = NULL;
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL){
+        fprintf(stderr, "ntscjpng: bench: %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    bool result = false;
+    if ((fseek(file, 0, SEEK_END) == 0)){
+        long size = ftell(file);
+        if ((size > 0) && (fseek(file, 0, SEEK_SET) == 0)){
+            bi->png = malloc(size);
+            if ((bi->png != NULL) && (fread(bi->png, 1, size, file) == (size_t)size)){
+                bi->pngsize = size;
+                result = true;
+            }
+        }
+    }
+    fclose(file);
+    if (!result){
+        fprintf(stderr, "ntscjpng: bench: cannot read %s\n", filename);
+        free(bi->png);
+        bi->png = NULL;
+        return false;
+    }
+    // show just the file name, not the whole path
+    const char* name = strrchr(filename, '/');
+    name = (name != NULL) ? name + 1 : filename;
+    snprintf(bi->name, sizeof bi->name, "%s", name);
+    return true;
+}
 
-         else {
-            fprintf(stderr, "ntscjpng: out of memory: %lu bytes\n", (unsigned long)PNG_IMAGE_SIZE(image));
+void printbenchmarkstage(const char* name, const char* stage, double pixels, double* times, int iterations){
+    qsort(times, iterations, sizeof(double), comparedouble);
+    int p99 = (int)ceil(0.99 * iterations) - 1;
+    // fastest time is the best throughput; the p99 time is the slow tail
+    printf("%-28s %-8s %12.2f %12.2f %12.2f\n", name, stage, pixels / times[0] * 1.0e-6, pixels / times[iterations / 2] * 1.0e-6, pixels / times[p99] * 1.0e-6);
+}
 
-            /* This is the only place where a 'free' is required; libpng does
-             * the cleanup on error and success, but in this case we couldn't
-             * complete the read because of running out of memory and so libpng
-             * has not got to the point where it can do cleanup.
-             */
+// Decode, convert, and encode one image iterations times, and print Mpix/s for each stage. Returns false on failure.
+bool benchmarkone(benchmarkimage* bi, int mode, int iterations, workspace* ws){
+    double* times = malloc(sizeof(double) * 3 * iterations);
+    png_bytep output = NULL;
+    png_alloc_size_t outputcapacity = 0;
+    if (times == NULL) return false;
+    double* decodetimes = times;
+    double* converttimes = times + iterations;
+    double* encodetimes = times + (2 * iterations);
+    bool result = true;
+    double pixels = 0.0;
+    
+    for (int i=0; (i<iterations) && result; i++){
+        png_image image;
+        memset(&image, 0, sizeof image);
+        image.version = PNG_IMAGE_VERSION;
+        
+        double start = secondsnow();
+        if (!png_image_begin_read_from_memory(&image, bi->png, bi->pngsize)){
+            fprintf(stderr, "ntscjpng: bench: %s: %s\n", bi->name, image.message);
+            result = false;
+            break;
+        }
+        image.format = readformat(&image, ws->settings);
+        if (!reserveworkspace(ws, PNG_IMAGE_SIZE(image))){
+            fprintf(stderr, "ntscjpng: bench: out of memory\n");
             png_image_free(&image);
+            result = false;
+            break;
+        }
+        if (!png_image_finish_read(&image, NULL, ws->buffer, 0, NULL)){
+            fprintf(stderr, "ntscjpng: bench: %s: %s\n", bi->name, image.message);
+            result = false;
+            break;
+        }
+        double decoded = secondsnow();
+        
+        convertimage(ws->buffer, image.width, image.height, PNG_IMAGE_PIXEL_CHANNELS(image.format), mode, ws);
+        double converted = secondsnow();
+        
+        png_alloc_size_t size = PNG_IMAGE_PNG_SIZE_MAX(image);
+        if (size > outputcapacity){
+            free(output);
+            output = malloc(size);
+            outputcapacity = (output != NULL) ? size : 0;
+            if (output == NULL){
+                fprintf(stderr, "ntscjpng: bench: out of memory\n");
+                result = false;
+                break;
+            }
+        }
+        double encodestart = secondsnow();
+        if (!png_image_write_to_memory(&image, output, &size, 0, ws->buffer, 0, NULL)){
+            fprintf(stderr, "ntscjpng: bench: encoding %s: %s\n", bi->name, image.message);
+            result = false;
+            break;
+        }
+        double encoded = secondsnow();
+        
+        decodetimes[i] = decoded - start;
+        converttimes[i] = converted - decoded;
+        encodetimes[i] = encoded - encodestart;
+        pixels = (double)image.width * image.height;
+    }
+    
+    if (result){
+        printbenchmarkstage(bi->name, "decode", pixels, decodetimes, iterations);
+        printbenchmarkstage(bi->name, "convert", pixels, converttimes, iterations);
+        printbenchmarkstage(bi->name, "encode", pixels, encodetimes, iterations);
+    }
+    free(output);
+    free(times);
+    return result;
+}
+
+// Benchmark the synthetic workloads, or the given files if there are any. Returns the number of failures.
+int runbenchmark(const char** files, int filecount, int mode, int iterations, const ntscj_options* options){
+    workspace ws;
+    if (!initworkspace(&ws, options)){
+        fprintf(stderr, "ntscjpng: bench: out of memory\n");
+        return 1;
+    }
+    // what the cpu is running, if it isn't the gpu
+    ntscj_options cpuoptions = *options;
+    cpuoptions.gpu = false;
+    cpuoptions.fixed = options->fixed || options->gpu;
+    
+    printf("ntscjpng bench: %s, %i thread(s), %s matrix kernel, %s gamma encode%s, %i iterations\n", (mode == 1) ? "ntscj-to-srgb" : "srgb-to-ntscj", options->threads, ntscj_context_uses_gpu(ws.context) ? "opencl" : ntscj_kernel_name(&cpuoptions), (options->fixed || options->gpu) ? "fixed-point" : (options->exact ? "exact" : "table"), options->memo ? ", memo" : "", iterations);
+    printf("%-28s %-8s %12s %12s %12s\n", "image", "stage", "best Mpix/s", "median", "p99");
+    
+    int failures = 0;
+    int count = (filecount > 0) ? filecount : 3;
+    for (int i=0; i<count; i++){
+        benchmarkimage bi;
+        bool loaded = (filecount > 0) ? loadbenchmarkimage(&bi, files[i]) : makesyntheticimage(&bi, i);
+        if (!loaded){
+            failures++;
+            continue;
+        }
+        if (!benchmarkone(&bi, mode, iterations, &ws)){
+            failures++;
+        }
+        free(bi.png);
+    }
+    
+    freeworkspace(&ws);
+    return failures;
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+// 3D LUT files
+
+// Write a LUT as an Adobe/Resolve .cube file. Returns true on success.
+bool writecubefile(const char* outputfile, const ntscj_lut* lut, const char* title){
+    FILE* output = fopen(outputfile, "w");
+    if (output == NULL){
+        fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+        return false;
+    }
+    int size = ntscj_lut_size(lut);
+    const float* values = ntscj_lut_values(lut);
+    fprintf(output, "# Created by ntscjpng %s\nTITLE \"%s\"\nLUT_3D_SIZE %i\nDOMAIN_MIN 0.0 0.0 0.0\nDOMAIN_MAX 1.0 1.0 1.0\n", NTSCJ_VERSION, title, size);
+    size_t count = (size_t)size * size * size;
+    for (size_t i=0; i<count; i++){
+        fprintf(output, "%.6f %.6f %.6f\n", values[(i * 3)], values[(i * 3) + 1], values[(i * 3) + 2]);
+    }
+    bool result = !ferror(output);
+    if ((fclose(output) != 0) || !result){
+        fprintf(stderr, "ntscjpng: write %s: %s\n", outputfile, strerror(errno));
+        remove(outputfile);
+        return false;
+    }
+    return true;
+}
+
+// Write a LUT as a 16-bit Hald CLUT png. The LUT size has to be a square, level^2; the image is level^3 pixels on a side,
+// with red changing fastest, then green, then blue, reading left to right and top to bottom.
+bool writehaldfile(const char* outputfile, const ntscj_lut* lut, const pngprofile* profile){
+    int size = ntscj_lut_size(lut);
+    int level = (int)lround(sqrt((double)size));
+    if (level * level != size){
+        fprintf(stderr, "ntscjpng: a Hald CLUT needs a square LUT size (16, 25, 36, 49, 64, ...), not %i\n", size);
+        return false;
+    }
+    int side = level * level * level;
+    uint16_t* pixels = malloc((size_t)side * side * 3 * sizeof(uint16_t));
+    if (pixels == NULL){
+        fprintf(stderr, "ntscjpng: out of memory writing %s\n", outputfile);
+        return false;
+    }
+    // the LUT is already in Hald order, so it's just a matter of writing it out as 16-bit
+    const float* values = ntscj_lut_values(lut);
+    size_t count = (size_t)side * side * 3;
+    for (size_t i=0; i<count; i++){
+        pixels[i] = (uint16_t)lround(values[i] * 65535.0);
+    }
+    bool result = writepngfile(outputfile, (png_bytep)pixels, side, side, PNG_COLOR_TYPE_RGB, 16, NULL, 0, profile);
+    free(pixels);
+    return result;
+}
+
+// Read a .cube file. Only 3D LUTs over the default 0-1 domain are supported. Returns NULL, after saying why, on failure.
+ntscj_lut* loadcubefile(const char* inputfile){
+    FILE* input = fopen(inputfile, "r");
+    if (input == NULL){
+        fprintf(stderr, "ntscjpng: %s: %s\n", inputfile, strerror(errno));
+        return NULL;
+    }
+    int size = 0;
+    size_t count = 0;
+    size_t expected = 0;
+    float* values = NULL;
+    bool ok = true;
+    int linenumber = 0;
+    char line[512];
+    while (ok && (fgets(line, sizeof line, input) != NULL)){
+        linenumber++;
+        char* start = line;
+        while ((*start == ' ') || (*start == '\t')) start++;
+        if ((*start == '#') || (*start == '\n') || (*start == '\r') || (*start == '\0')) continue;
+        float r, g, b;
+        if (strncmp(start, "LUT_3D_SIZE", 11) == 0){
+            if ((size > 0) || (sscanf(start + 11, "%i", &size) != 1) || (size < 2) || (size > NTSCJ_MAX_LUT_SIZE)){
+                fprintf(stderr, "ntscjpng: %s line %i: bad or repeated LUT_3D_SIZE (2 to %i)\n", inputfile, linenumber, NTSCJ_MAX_LUT_SIZE);
+                ok = false;
+                break;
+            }
+            expected = (size_t)size * size * size;
+            values = malloc(expected * 3 * sizeof(float));
+            if (values == NULL){
+                fprintf(stderr, "ntscjpng: out of memory reading %s\n", inputfile);
+                ok = false;
+            }
+        }
+        else if ((strncmp(start, "DOMAIN_MIN", 10) == 0) || (strncmp(start, "DOMAIN_MAX", 10) == 0)){
+            float want = (start[9] == 'N') ? 0.0 : 1.0;
+            if ((sscanf(start + 10, "%f %f %f", &r, &g, &b) != 3) || (r != want) || (g != want) || (b != want)){
+                fprintf(stderr, "ntscjpng: %s line %i: only the default 0-1 domain is supported\n", inputfile, linenumber);
+                ok = false;
+            }
+        }
+        else if (strncmp(start, "LUT_1D_SIZE", 11) == 0){
+            fprintf(stderr, "ntscjpng: %s: 1D LUTs are not supported\n", inputfile);
+            ok = false;
+        }
+        else if (strncmp(start, "TITLE", 5) == 0){
+            // nothing to do
+        }
+        else if (sscanf(start, "%f %f %f", &r, &g, &b) == 3){
+            if ((values == NULL) || (count >= expected)){
+                fprintf(stderr, "ntscjpng: %s line %i: %s\n", inputfile, linenumber, (values == NULL) ? "data before LUT_3D_SIZE" : "too many entries");
+                ok = false;
+                break;
+            }
+            values[(count * 3)] = r;
+            values[(count * 3) + 1] = g;
+            values[(count * 3) + 2] = b;
+            count++;
+        }
+        else {
+            fprintf(stderr, "ntscjpng: %s line %i: not a .cube line\n", inputfile, linenumber);
+            ok = false;
+        }
+    }
+    if (ok && ferror(input)){
+        fprintf(stderr, "ntscjpng: read %s: %s\n", inputfile, strerror(errno));
+        ok = false;
+    }
+    fclose(input);
+    if (ok && ((values == NULL) || (count != expected))){
+        fprintf(stderr, "ntscjpng: %s: expected %lu entries, found %lu\n", inputfile, (unsigned long)expected, (unsigned long)count);
+        ok = false;
+    }
+    ntscj_lut* lut = NULL;
+    if (ok){
+        lut = ntscj_create_lut(size, values);
+        if (lut == NULL) fprintf(stderr, "ntscjpng: out of memory reading %s\n", inputfile);
+    }
+    free(values);
+    return lut;
+}
+
+// ntscjpng lut mode size output: sample the conversion on a grid and write it as .cube, or as a Hald CLUT if output ends in .png.
+int exportlut(int mode, int size, const char* outputfile, const ntscj_options* options, const pngprofile* profile){
+    size_t length = strlen(outputfile);
+    bool hald = haspngextension(outputfile);
+    if (!hald && !((length > 5) && (strcasecmp(outputfile + length - 5, ".cube") == 0))){
+        fprintf(stderr, "ntscjpng: lut output must be a .cube or .png file\n");
+        return 1;
+    }
+    ntscj_lut* lut = ntscj_make_lut(size, (ntscj_direction)mode, options);
+    if (lut == NULL){
+        fprintf(stderr, "ntscjpng: cannot make a %i point LUT (2 to %i, and there has to be memory for it)\n", size, NTSCJ_MAX_LUT_SIZE);
+        return 1;
+    }
+    const char* gamut = (options->profile != NULL) ? ntscj_profile_name(options->profile) : "NTSC-J";
+    char title[512];
+    snprintf(title, sizeof title, (mode == 1) ? "%s to sRGB" : "sRGB to %s", gamut);
+    bool result = hald ? writehaldfile(outputfile, lut, profile) : writecubefile(outputfile, lut, title);
+    ntscj_free_lut(lut);
+    if (result){
+        printf("ntscjpng: wrote %i point %s LUT to %s\n", size, title, outputfile);
+    }
+    return result ? 0 : 1;
+}
+
+// --gamut: a built-in profile's name, or "rx,ry,gx,gy,bx,by,wx,wy" chromaticities, which become a profile named for the text.
+// Returns NULL, after saying why, if it's neither.
+const ntscj_profile* parsegamut(const char* text){
+    const ntscj_profile* profile = ntscj_find_profile(text);
+    if (profile != NULL) return profile;
+    ntscj_gamut gamut;
+    char extra;
+    if (sscanf(text, "%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf %c", &gamut.red[0], &gamut.red[1], &gamut.green[0], &gamut.green[1],
+               &gamut.blue[0], &gamut.blue[1], &gamut.white[0], &gamut.white[1], &extra) != 8){
+        fprintf(stderr, "ntscjpng: --gamut: %s isn't a built-in gamut (ntscj, ntscj-broadcast, d93, ntsc1953, smpte-c, or pal) or rx,ry,gx,gy,bx,by,wx,wy chromaticities\n", text);
+        return NULL;
+    }
+    profile = ntscj_add_profile(text, &gamut);
+    if (profile == NULL){
+        fprintf(stderr, "ntscjpng: --gamut: %s isn't a usable gamut (or it's too far from sRGB)\n", text);
+    }
+    return profile;
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------
+// Rectangles and masks
+
+// The rectangles from --rect and --tiles. They must not overlap.
+typedef struct rectlist {
+    ntscj_rect* rects;
+    int count;
+    int capacity;
+} rectlist;
+
+// Parse "x,y,width,height". Returns false if that isn't what it is.
+bool parserect(const char* text, ntscj_rect* rect){
+    char extra;
+    return (sscanf(text, "%i,%i,%i,%i %c", &rect->x, &rect->y, &rect->width, &rect->height, &extra) == 4) && (rect->width > 0) && (rect->height > 0);
+}
+
+// Returns false, after saying why, if the rectangle overlaps one already in the list or there's no memory. where is for the messages.
+bool addrect(rectlist* list, ntscj_rect rect, const char* where){
+    for (int i=0; i<list->count; i++){
+        const ntscj_rect* other = &list->rects[i];
+        if (((long long)rect.x < (long long)other->x + other->width) && ((long long)other->x < (long long)rect.x + rect.width) &&
+            ((long long)rect.y < (long long)other->y + other->height) && ((long long)other->y < (long long)rect.y + rect.height)){
+            fprintf(stderr, "ntscjpng: %s: rectangle overlaps %i,%i,%i,%i\n", where, other->x, other->y, other->width, other->height);
+            return false;
+        }
+    }
+    if (list->count == list->capacity){
+        int capacity = (list->capacity == 0) ? 16 : list->capacity * 2;
+        ntscj_rect* newrects = realloc(list->rects, capacity * sizeof(ntscj_rect));
+        if (newrects == NULL){
+            fprintf(stderr, "ntscjpng: out of memory\n");
+            return false;
+        }
+        list->rects = newrects;
+        list->capacity = capacity;
+    }
+    list->rects[list->count++] = rect;
+    return true;
+}
+
+// Read a --tiles file into the list: one "x,y,width,height" rectangle per line, with blank lines and # comments ignored.
+// Rectangles may hang off the edge of an image. Returns false, after saying why, on failure.
+bool readtilefile(const char* inputfile, rectlist* list){
+    FILE* input = fopen(inputfile, "r");
+    if (input == NULL){
+        fprintf(stderr, "ntscjpng: %s: %s\n", inputfile, strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    int linenumber = 0;
+    char line[512];
+    char where[4096 + 32];
+    while (ok && (fgets(line, sizeof line, input) != NULL)){
+        linenumber++;
+        char* start = line;
+        while ((*start == ' ') || (*start == '\t')) start++;
+        if ((*start == '#') || (*start == '\n') || (*start == '\r') || (*start == '\0')) continue;
+        ntscj_rect rect;
+        snprintf(where, sizeof where, "%s line %i", inputfile, linenumber);
+        if (!parserect(start, &rect)){
+            fprintf(stderr, "ntscjpng: %s: expected x,y,width,height\n", where);
+            ok = false;
+        }
+        else {
+            ok = addrect(list, rect, where);
+        }
+    }
+    if (ok && ferror(input)){
+        fprintf(stderr, "ntscjpng: read %s: %s\n", inputfile, strerror(errno));
+        ok = false;
+    }
+    fclose(input);
+    return ok;
+}
+
+// Read a --mask png: a pixel is selected wherever the mask isn't black, unless it's fully transparent there.
+// Returns one byte per pixel, nonzero for selected, or NULL after saying why.
+uint8_t* loadmaskfile(const char* inputfile, int* width, int* height){
+    png_image image;
+    memset(&image, 0, sizeof image);
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file(&image, inputfile)){
+        fprintf(stderr, "ntscjpng: %s: %s\n", inputfile, image.message);
+        return NULL;
+    }
+    image.format = PNG_FORMAT_GA;
+    png_bytep pixels = malloc(PNG_IMAGE_SIZE(image));
+    uint8_t* mask = malloc((size_t)image.width * image.height);
+    if ((pixels == NULL) || (mask == NULL)){
+        fprintf(stderr, "ntscjpng: out of memory reading %s\n", inputfile);
+        png_image_free(&image);
+        free(pixels);
+        free(mask);
+        return NULL;
+    }
+    if (!png_image_finish_read(&image, NULL, pixels, 0, NULL)){
+        fprintf(stderr, "ntscjpng: read %s: %s\n", inputfile, image.message);
+        free(pixels);
+        free(mask);
+        return NULL;
+    }
+    size_t count = (size_t)image.width * image.height;
+    for (size_t i=0; i<count; i++){
+        mask[i] = ((pixels[(i * 2)] != 0) && (pixels[(i * 2) + 1] != 0)) ? 1 : 0;
+    }
+    free(pixels);
+    *width = image.width;
+    *height = image.height;
+    return mask;
+}
+
+int main(int argc, const char **argv){
+   
+   int result = 1;
+
+   // options may appear anywhere; everything else is mode followed by input/output file pairs
+   ntscj_options options;
+   ntscj_default_options(&options);
+   runsettings settings = defaultsettings;
+   pngprofile* profile = &settings.profile;
+   int jobs = 1;
+   int iterations = 10;
+   const char* batchfile = NULL;
+   const char* lutfile = NULL;
+   const char* tilefile = NULL;
+   const char* maskfile = NULL;
+   rectlist rects = {NULL, 0, 0};
+   ntscj_lut* lut = NULL;
+   uint8_t* mask = NULL;
+   const char* inputdir = NULL;
+   const char* outputdir = NULL;
+   const char** positional = malloc(argc * sizeof(const char*));
+   int positionalcount = 0;
+   bool badargs = (positional == NULL);
+   for (int i=1; (i<argc) && !badargs; i++){
+      if (strcmp(argv[i], "--memo") == 0){
+         options.memo = true;
+      }
+      else if (strcmp(argv[i], "--exact") == 0){
+         options.exact = true;
+      }
+      else if (strcmp(argv[i], "--fixed") == 0){
+         options.fixed = true;
+      }
+      else if (strcmp(argv[i], "--gpu") == 0){
+         options.gpu = true;
+      }
+      else if ((strcmp(argv[i], "--lut") == 0) && (i + 1 < argc)){
+         lutfile = argv[++i];
+      }
+      else if (strcmp(argv[i], "--trilinear") == 0){
+         options.trilinear = true;
+      }
+      else if (strcmp(argv[i], "--skip-transparent") == 0){
+         options.skiptransparent = true;
+      }
+      else if (strcmp(argv[i], "--stream") == 0){
+         settings.stream = true;
+      }
+      else if (strcmp(argv[i], "--stats") == 0){
+         settings.printstats = true;
+      }
+      else if (strcmp(argv[i], "--analyze") == 0){
+         settings.analyze = true;
+      }
+      else if (strcmp(argv[i], "--png-fast") == 0){
+         // for intermediate files: barely compress, with the cheapest useful filter
+         profile->custom = true;
+         profile->level = 1;
+         profile->strategy = Z_RLE;
+         profile->filters = PNG_FILTER_SUB;
+      }
+      else if (strcmp(argv[i], "--png-small") == 0){
+         // for release assets: best compression, try every filter
+         profile->custom = true;
+         profile->level = 9;
+         profile->strategy = Z_DEFAULT_STRATEGY;
+         profile->filters = PNG_ALL_FILTERS;
+      }
+      else if ((strcmp(argv[i], "--zlib-level") == 0) && (i + 1 < argc)){
+         char* end;
+         profile->custom = true;
+         profile->level = (int)strtol(argv[++i], &end, 10);
+         if ((*end != '\0') || (profile->level < 0) || (profile->level > 9)){
+            badargs = true;
          }
       }
-
+      else if ((strcmp(argv[i], "--zlib-strategy") == 0) && (i + 1 < argc)){
+         const char* names[5] = {"default", "filtered", "huffman", "rle", "fixed"};
+         const int strategies[5] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED};
+         i++;
+         profile->custom = true;
+         profile->strategy = -1;
+         for (int j=0; j<5; j++){
+            if (strcmp(argv[i], names[j]) == 0) profile->strategy = strategies[j];
+         }
+         if (profile->strategy < 0) badargs = true;
+      }
+      else if ((strcmp(argv[i], "--png-filters") == 0) && (i + 1 < argc)){
+         // comma separated list
+         const char* names[6] = {"none", "sub", "up", "avg", "paeth", "all"};
+         const int filters[6] = {PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_ALL_FILTERS};
+         const char* list = argv[++i];
+         profile->custom = true;
+         profile->filters = 0;
+         while (*list != '\0'){
+            size_t length = strcspn(list, ",");
+            bool found = false;
+            for (int j=0; j<6; j++){
+               if ((strlen(names[j]) == length) && (strncmp(list, names[j], length) == 0)){
+                  profile->filters |= filters[j];
+                  found = true;
+               }
+            }
+            if (!found) badargs = true;
+            list += length;
+            if (*list == ',') list++;
+         }
+         if (profile->filters == 0) badargs = true;
+      }
+      else if (((strcmp(argv[i], "--raw") == 0) || (strcmp(argv[i], "--video") == 0)) && (i + 1 < argc)){
+         // WIDTHxHEIGHT
+         settings.video = (strcmp(argv[i], "--video") == 0);
+         char* end;
+         settings.rawwidth = (int)strtol(argv[++i], &end, 10);
+         if (*end == 'x'){
+            settings.rawheight = (int)strtol(end + 1, &end, 10);
+         }
+         if ((*end != '\0') || (settings.rawwidth <= 0) || (settings.rawheight <= 0)){
+            badargs = true;
+         }
+      }
+      else if ((strcmp(argv[i], "--cache-dir") == 0) && (i + 1 < argc)){
+         settings.cachedir = argv[++i];
+      }
+      else if (strcmp(argv[i], "--palette") == 0){
+         settings.palette = true;
+      }
+      else if (strcmp(argv[i], "--cache-link") == 0){
+         settings.cachelink = true;
+      }
+      else if (strcmp(argv[i], "--16bit") == 0){
+         settings.sixteenbit = true;
+      }
+      else if (strcmp(argv[i], "--rgba") == 0){
+         settings.rgba = true;
+      }
+      else if ((strcmp(argv[i], "--tile") == 0) && (i + 1 < argc)){
+         char* end;
+         settings.tilesize = (int)strtol(argv[++i], &end, 10);
+         if ((*end != '\0') || (settings.tilesize < 1)){
+            badargs = true;
+         }
+      }
+      else if ((strcmp(argv[i], "--tiles") == 0) && (i + 1 < argc)){
+         tilefile = argv[++i];
+      }
+      else if ((strcmp(argv[i], "--rect") == 0) && (i + 1 < argc)){
+         ntscj_rect rect;
+         i++;
+         if (!parserect(argv[i], &rect)){
+            badargs = true;
+         }
+         else if (!addrect(&rects, rect, "--rect")){
+            goto cleanup;
+         }
+      }
+      else if (((strcmp(argv[i], "--decode-gamma") == 0) || (strcmp(argv[i], "--encode-gamma") == 0)) && (i + 1 < argc)){
+         ntscj_transfer* target = (strcmp(argv[i], "--decode-gamma") == 0) ? &options.decode : &options.encode;
+         i++;
+         if (strcmp(argv[i], "srgb") == 0){
+            *target = NTSCJ_TRANSFER_SRGB;
+         }
+         else if (strcmp(argv[i], "2.2") == 0){
+            *target = NTSCJ_TRANSFER_GAMMA22;
+         }
+         else if (strcmp(argv[i], "bt1886") == 0){
+            *target = NTSCJ_TRANSFER_BT1886;
+         }
+         else {
+            badargs = true;
+         }
+      }
+      else if ((strcmp(argv[i], "--gamut") == 0) && (i + 1 < argc)){
+         options.profile = parsegamut(argv[++i]);
+         if (options.profile == NULL){
+            goto cleanup;
+         }
+      }
+      else if ((strcmp(argv[i], "--mask") == 0) && (i + 1 < argc)){
+         maskfile = argv[++i];
+      }
+      else if (strcmp(argv[i], "--no-simd") == 0){
+         options.simd = false;
+      }
+      else if ((strcmp(argv[i], "--iterations") == 0) && (i + 1 < argc)){
+         char* end;
+         iterations = (int)strtol(argv[++i], &end, 10);
+         if ((*end != '\0') || (iterations < 1)){
+            badargs = true;
+         }
+      }
+      else if (((strcmp(argv[i], "--threads") == 0) || (strcmp(argv[i], "--jobs") == 0)) && (i + 1 < argc)){
+         int* target = (strcmp(argv[i], "--threads") == 0) ? &options.threads : &jobs;
+         char* end;
+         *target = (int)strtol(argv[++i], &end, 10);
+         if ((*end != '\0') || (*target < 0)){
+            badargs = true;
+         }
+         // 0 means one per CPU
+         if (*target == 0){
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            *target = (cpus > 0) ? (int)cpus : 1;
+         }
+         if (*target > NTSCJ_MAX_THREADS) *target = NTSCJ_MAX_THREADS;
+      }
+      else if ((strcmp(argv[i], "--batch") == 0) && (i + 1 < argc)){
+         batchfile = argv[++i];
+      }
+      else if ((strcmp(argv[i], "--dir") == 0) && (i + 2 < argc)){
+         inputdir = argv[++i];
+         outputdir = argv[++i];
+      }
+      else if ((strncmp(argv[i], "--", 2) == 0) && (strlen(argv[i]) > 2)){
+         badargs = true;
+      }
       else {
-         /* Failed to read the input file argument: */
-         fprintf(stderr, "ntscjpng: %s: %s\n", argv[2], image.message);
+         positional[positionalcount++] = argv[i];
+      }
+   }
+   
+   // the 16-bit path is floating point only, and --raw and --palette are 8-bit by definition
+   if (!badargs && settings.sixteenbit && (options.fixed || options.gpu || (lutfile != NULL) || (settings.rawwidth > 0) || settings.palette)){
+      fprintf(stderr, "ntscjpng: --16bit can't be combined with --fixed, --gpu, --lut, --raw, or --palette\n");
+      goto cleanup;
+   }
+   
+   // --analyze only reads pngs, and has nothing to cache
+   if (!badargs && settings.analyze && ((settings.rawwidth > 0) || settings.sixteenbit || settings.palette || (settings.cachedir != NULL))){
+      fprintf(stderr, "ntscjpng: --analyze can't be combined with --raw, --video, --16bit, --palette, or --cache-dir\n");
+      goto cleanup;
+   }
+   
+   // the fixed-point tables are sRGB only, and a LUT already has its curves baked in
+   if (!badargs && ((options.decode != NTSCJ_TRANSFER_SRGB) || (options.encode != NTSCJ_TRANSFER_SRGB)) && (options.fixed || options.gpu || (lutfile != NULL))){
+      fprintf(stderr, "ntscjpng: --decode-gamma and --encode-gamma can't be combined with --fixed, --gpu, or --lut\n");
+      goto cleanup;
+   }
+   
+   // a LUT from a file takes over the conversion
+   if (!badargs && (lutfile != NULL)){
+      lut = loadcubefile(lutfile);
+      if (lut == NULL){
+         goto cleanup;
+      }
+      options.lut = lut;
+   }
+   
+   // ntscjpng bench [mode] [files...]
+   if (!badargs && (positionalcount > 0) && (strcmp(positional[0], "bench") == 0)){
+      int benchmode = 1;
+      int first = 1;
+      if ((positionalcount > 1) && (strcmp(positional[1], "srgb-to-ntscj") == 0)){
+         benchmode = 2;
+         first = 2;
+      }
+      else if ((positionalcount > 1) && (strcmp(positional[1], "ntscj-to-srgb") == 0)){
+         first = 2;
+      }
+      result = (runbenchmark(positional + first, positionalcount - first, benchmode, iterations, &options) == 0) ? 0 : 1;
+      goto cleanup;
+   }
+   
+   // ntscjpng lut mode size output
+   if (!badargs && (positionalcount == 4) && (strcmp(positional[0], "lut") == 0)){
+      int lutmode = (strcmp(positional[1], "ntscj-to-srgb") == 0) ? 1 : ((strcmp(positional[1], "srgb-to-ntscj") == 0) ? 2 : 0);
+      char* end;
+      int size = (int)strtol(positional[2], &end, 10);
+      if ((lutmode > 0) && (*end == '\0')){
+         result = exportlut(lutmode, size, positional[3], &options, &settings.profile);
+         goto cleanup;
+      }
+      badargs = true;
+   }
+   
+   // ntscjpng selftest [exhaustive [passes]]
+   if (!badargs && (positionalcount >= 1) && (positionalcount <= 3) && (strcmp(positional[0], "selftest") == 0)){
+      long long mismatches = -1;
+      if (positionalcount == 1){
+         mismatches = ntscj_self_test(stdout);
+      }
+      else if (strcmp(positional[1], "exhaustive") == 0){
+         int passes = 2;
+         char* end = "";
+         if (positionalcount == 3) passes = (int)strtol(positional[2], &end, 10);
+         if ((*end == '\0') && (passes >= 1) && (passes <= 64)){
+            mismatches = ntscj_self_test_exhaustive(stdout, &options, passes);
+         }
+      }
+      if (mismatches >= 0){
+         printf("ntscjpng selftest: %s\n", (mismatches == 0) ? "passed" : "FAILED");
+         result = (mismatches == 0) ? 0 : 1;
+         goto cleanup;
+      }
+      badargs = true;
+   }
+   
+   // only the conversion itself needs the tile descriptor and the mask
+   if (!badargs && ((tilefile != NULL) || (rects.count > 0) || (maskfile != NULL)) && settings.palette){
+      fprintf(stderr, "ntscjpng: --tiles, --rect, and --mask can't be combined with --palette\n");
+      badargs = true;
+   }
+   if (!badargs && (tilefile != NULL)){
+      if (!readtilefile(tilefile, &rects)){
+         goto cleanup;
+      }
+      if (rects.count == 0){
+         fprintf(stderr, "ntscjpng: %s has no rectangles\n", tilefile);
+         goto cleanup;
+      }
+   }
+   if (!badargs && (maskfile != NULL)){
+      mask = loadmaskfile(maskfile, &settings.maskwidth, &settings.maskheight);
+      if (mask == NULL){
+         goto cleanup;
+      }
+      settings.mask = mask;
+   }
+   settings.rects = rects.rects;
+   settings.rectcount = rects.count;
+   
+   int mode = 0;
+   // need the mode plus whole input/output pairs (or just inputs, with --analyze), and at least one unless there's a batch file or directory
+   if (!badargs && ((positionalcount % 2 == 1) || (settings.analyze && (positionalcount > 0))) && ((positionalcount > 1) || (batchfile != NULL) || (inputdir != NULL))){
+      if (strcmp(positional[0], "ntscj-to-srgb") == 0){
+        mode = 1;
+      }
+      else if (strcmp(positional[0], "srgb-to-ntscj") == 0){
+        mode = 2;
+      }
+   }
+   if ((mode > 0) && (settings.cachedir != NULL)){
+      if ((mkdir(settings.cachedir, 0777) != 0) && (errno != EEXIST)){
+         fprintf(stderr, "ntscjpng: cannot create cache directory %s: %s\n", settings.cachedir, strerror(errno));
+         goto cleanup;
+      }
+      settings.cacheseed = makecacheseed(&options, &settings);
+   }
+   if (mode > 0){
+      
+      joblist list;
+      initjoblist(&list);
+      int failures = 0;
+      for (int i=1; (i<positionalcount) && !settings.analyze; i+=2){
+         if (!addjob(&list, positional[i], positional[i+1])){
+            fprintf(stderr, "ntscjpng: out of memory\n");
+            failures++;
+         }
+      }
+      // inputs to analyze may be directories, to take every .png under them
+      for (int i=1; (i<positionalcount) && settings.analyze; i++){
+         struct stat info;
+         if ((stat(positional[i], &info) == 0) && S_ISDIR(info.st_mode)){
+            failures += readdirectorytree(positional[i], NULL, &list);
+         }
+         else if (!addjob(&list, positional[i], NULL)){
+            fprintf(stderr, "ntscjpng: out of memory\n");
+            failures++;
+         }
+      }
+      
+      if (batchfile != NULL){
+         if (strcmp(batchfile, "-") == 0){
+            failures += readbatchlist(stdin, "stdin", &list);
+         }
+         else {
+            FILE* file = fopen(batchfile, "r");
+            if (file != NULL){
+               failures += readbatchlist(file, batchfile, &list);
+               fclose(file);
+            }
+            else {
+               fprintf(stderr, "ntscjpng: cannot open batch file %s\n", batchfile);
+               failures++;
+            }
+         }
+      }
+      
+      if (inputdir != NULL){
+         failures += readdirectorytree(inputdir, settings.analyze ? NULL : outputdir, &list);
+      }
+      
+      failures += convertjobs(&list, mode, jobs, &options, &settings);
+      
+      freejoblist(&list);
+      
+      if (failures == 0){
+         result = 0;
       }
    }
 
    else {
       /* Wrong number of arguments */
-      fprintf(stderr, "ntscjpng: usage: ntscjpng mode input-file output-file, where mode is \"ntscj-to-srgb\" or \"srgb-to-ntscj\" \n");
+      fprintf(stderr, "ntscjpng: usage: ntscjpng [options] mode input-file output-file [input-file output-file ...], where mode is \"ntscj-to-srgb\" or \"srgb-to-ntscj\" \n");
+      fprintf(stderr, "       ntscjpng [options] --analyze mode input-file|input-dir [...], to print a JSON line per png with how much converting it would change, without writing anything\n");
+      fprintf(stderr, "       ntscjpng [options] bench [mode] [file ...], to time decode, conversion, and encode over synthetic images or the given files\n");
+      fprintf(stderr, "       ntscjpng selftest, to check the fast paths against the reference code\n");
+      fprintf(stderr, "       ntscjpng [--gamut G] [--decode-gamma C] [--encode-gamma C] selftest exhaustive [passes], to check every color through every kernel (passes default 2)\n");
+      fprintf(stderr, "       ntscjpng [--exact] [--gamut G] [--decode-gamma C] [--encode-gamma C] lut mode size output.cube|output.png, to write the conversion as a 3D LUT (.png is a 16-bit Hald CLUT, size must be a square)\n");
+      fprintf(stderr, "options:\n");
+      fprintf(stderr, "  --memo             remember the conversion result for each unique input color (faster for images with few colors)\n");
+      fprintf(stderr, "  --exact            use pow() for the linear to sRGB step instead of the interpolated table\n");
+      fprintf(stderr, "  --no-simd          use the plain scalar matrix kernel even if the CPU has SSE2/AVX2/NEON\n");
+      fprintf(stderr, "  --fixed            use the all-integer pipeline, which gives the same output on every compiler and CPU\n");
+      fprintf(stderr, "  --gpu              convert on an OpenCL GPU if built with one (same output as --fixed, which is the fallback)\n");
+      fprintf(stderr, "  --gamut G          convert sRGB to and from gamut G instead of NTSC-J: ntscj-broadcast, d93, ntsc1953, smpte-c, pal, or rx,ry,gx,gy,bx,by,wx,wy\n");
+      fprintf(stderr, "  --decode-gamma C   decode the input to linear light with curve C: srgb (the default), 2.2 (pure power), or bt1886 (pure 2.4)\n");
+      fprintf(stderr, "  --encode-gamma C   encode the output from linear light with curve C, as for --decode-gamma\n");
+      fprintf(stderr, "  --lut FILE.cube    convert by interpolating this 3D LUT instead (the mode then only affects the messages)\n");
+      fprintf(stderr, "  --trilinear        interpolate the --lut trilinearly instead of tetrahedrally\n");
+      fprintf(stderr, "  --skip-transparent leave fully transparent pixels as they are instead of converting them (faster for sprite sheets)\n");
+      fprintf(stderr, "  --tile N           convert in NxN blocks shared out among the --threads instead of in row bands\n");
+      fprintf(stderr, "  --tiles FILE       convert only the rectangles listed in FILE, one \"x,y,width,height\" per line; the rest is copied as is\n");
+      fprintf(stderr, "  --rect X,Y,W,H     convert only this rectangle (may be given more than once, and combined with --tiles)\n");
+      fprintf(stderr, "  --mask FILE.png    convert only the pixels where this png, the same size as the input, isn't black or transparent\n");
+      fprintf(stderr, "  --threads N        split each image into N row bands converted in parallel (0 means one per CPU)\n");
+      fprintf(stderr, "  --stream           read, convert, and write a few rows at a time to save memory on huge images (not for interlaced input)\n");
+      fprintf(stderr, "  --jobs N           convert N files at the same time, biggest first (0 means one per CPU)\n");
+      fprintf(stderr, "  --batch FILE       also convert each \"input<tab>output\" pair listed in FILE, one per line (\"-\" reads stdin)\n");
+      fprintf(stderr, "  --dir INDIR OUTDIR also convert every .png under INDIR, writing to the same relative path under OUTDIR\n");
+      fprintf(stderr, "  --png-fast         compress the output png as little as is useful, for intermediate files\n");
+      fprintf(stderr, "  --png-small        compress the output png as much as possible, for release assets\n");
+      fprintf(stderr, "  --zlib-level N     zlib compression level for the output png, 0-9\n");
+      fprintf(stderr, "  --zlib-strategy S  zlib strategy for the output png: default, filtered, huffman, rle, or fixed\n");
+      fprintf(stderr, "  --png-filters LIST comma separated png row filters to try: none, sub, up, avg, paeth, all\n");
+      fprintf(stderr, "  --raw WxH          read and write headerless 8-bit RGBA of the given size instead of png (\"-\" for stdin/stdout)\n");
+      fprintf(stderr, "  --video WxH        like --raw, but for a stream of frames of that size, converted until the input runs out\n");
+      fprintf(stderr, "  --16bit            read up to 16 bits per channel (linear if the png says so) and write 16-bit output, dithered to 16 bits\n");
+      fprintf(stderr, "  --rgba             write RGBA even for input without alpha, which is otherwise converted and written as RGB\n");
+      fprintf(stderr, "  --palette          for colormapped pngs, convert just the palette (rounding instead of dithering) and keep the output colormapped\n");
+      fprintf(stderr, "  --cache-dir DIR    reuse earlier results for inputs with the same contents and options, kept in DIR\n");
+      fprintf(stderr, "  --cache-link       hard link cache hits to the output instead of copying them\n");
+      fprintf(stderr, "  --analyze          convert without encoding or writing, and print the changed pixel count, largest change, and clamped pixel counts\n");
+      fprintf(stderr, "  --stats            print a JSON line per file with stage timings, pixel count, and clamped pixel counts instead of the progress message\n");
+      fprintf(stderr, "  --iterations N     how many times bench runs each image (default 10)\n");
    }
+   
+cleanup:
+   free(positional);
+   ntscj_free_lut(lut);
+   free(rects.rects);
+   free(mask);
 
    return result;
 }